@@ -0,0 +1,568 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ */
+
+#include "boot_core.h"
+
+#include <stdint.h>
+
+#if (SPM_PAGESIZE-1) & SPM_PAGESIZE
+#  error SPM_PAGESIZE must be a power of 2
+#else
+#  define PAGE_ADDR_BASE(addr) ((addr) & ~(SPM_PAGESIZE-1))
+#  define PAGE_OFFSET(addr) ((addr) & (SPM_PAGESIZE-1))
+#endif
+
+/* Number of bytes following the length byte in an 'I' response. */
+#define BOOT_INFO_LENGTH 12
+
+/* Status bytes returned, with a sequence number, for a page sent with 'P'. */
+#define BOOT_ACK 'K'
+#define BOOT_NACK 'N'
+
+/* How long the line must stay quiet before BOOT_NACK or '?' goes out. */
+#define BOOT_QUIET_MS 20
+
+/* Byte the host sends at a new baud rate, for 'S' to answer with BOOT_ACK. */
+#define BOOT_PROBE 0x55
+
+/* How long 'S' waits for BOOT_PROBE before going back to the old rate. */
+#define BOOT_PROBE_MS 100
+
+/*
+ * Rates 'S' can switch to, numbered as in boot_baud_ubrr() and
+ * hexuploader.  The UART runs them at double speed, and only offers those
+ * that F_CPU divides down to within BOOT_BAUD_TOL percent.
+ */
+#define BOOT_BAUD_COUNT 10
+#define BOOT_BAUD_TOL 1
+#define NO_UBRR 0xFFFF
+
+#ifndef UART0_RX_BUFFER_SIZE
+#  define UART0_RX_BUFFER_SIZE 0
+#endif
+
+/*
+ * A polled UART isn't read while flash_poll() fills the SPM page buffer,
+ * about 8 cycles a byte, and only its 2-byte FIFO, 20 bit times, covers
+ * that.  Faster rates would overrun on every page, so they're only offered
+ * with an interrupt-driven receive path.
+ */
+#if UART0_RX_BUFFER_SIZE
+#  define BOOT_BAUD_MAX 0xFFFFFFFFUL
+#else
+#  define BOOT_BAUD_MAX (20UL * (F_CPU) / (8UL * SPM_PAGESIZE))
+#endif
+
+#define BOOT_UBRR(baud) (((F_CPU) + 4UL * (baud)) / (8UL * (baud)) - 1UL)
+#define BOOT_ACTUAL_BAUD(baud) ((F_CPU) / (8UL * (BOOT_UBRR(baud) + 1UL)))
+#define BOOT_BAUD_ERROR(baud)                                   \
+  (BOOT_ACTUAL_BAUD(baud) > (baud)                              \
+   ? BOOT_ACTUAL_BAUD(baud) - (baud)                            \
+   : (baud) - BOOT_ACTUAL_BAUD(baud))
+#define BOOT_BAUD_UBRR(baud)                                    \
+  ((F_CPU) >= 8UL * (baud) && (baud) <= BOOT_BAUD_MAX &&        \
+   BOOT_UBRR(baud) <= 0xFFF &&                                  \
+   100UL * BOOT_BAUD_ERROR(baud) <= BOOT_BAUD_TOL * (baud)      \
+   ? BOOT_UBRR(baud) : NO_UBRR)
+
+/**
+ * UBRR value, at double speed, for the rate numbered "index", or NO_UBRR
+ * if it isn't offered.  These all fold to constants.
+ */
+static uint16_t boot_baud_ubrr(uint8_t index) {
+  switch (index) {
+  case 0: return BOOT_BAUD_UBRR(9600UL);
+  case 1: return BOOT_BAUD_UBRR(19200UL);
+  case 2: return BOOT_BAUD_UBRR(38400UL);
+  case 3: return BOOT_BAUD_UBRR(57600UL);
+  case 4: return BOOT_BAUD_UBRR(115200UL);
+  case 5: return BOOT_BAUD_UBRR(230400UL);
+  case 6: return BOOT_BAUD_UBRR(250000UL);
+  case 7: return BOOT_BAUD_UBRR(500000UL);
+  case 8: return BOOT_BAUD_UBRR(1000000UL);
+  case 9: return BOOT_BAUD_UBRR(2000000UL);
+  default: return NO_UBRR;
+  }
+}
+
+/**
+ * https://en.wikipedia.org/wiki/Intel_HEX#Record_structure
+ */
+typedef struct {
+  uint8_t   length;
+  uint16_t  address;
+} IntelHexRecordHeader;
+
+/* Sentinel for g_page_addr when g_page holds no flash page. */
+#define NO_PAGE 0xFFFF
+
+/*
+ * Page data is received into one RAM buffer while the other waits for the
+ * flash engine.  The engine copies a page into the SPM page buffer before
+ * erasing, so a page being programmed holds no RAM at all, and the host
+ * may keep BOOT_PAGE_BUFFERS + 1 'P' frames in flight without the UART
+ * ever going unread.
+ */
+#define BOOT_PAGE_BUFFERS 2
+
+static uint8_t g_buffers[BOOT_PAGE_BUFFERS][SPM_PAGESIZE];
+static uint8_t* g_page = g_buffers[0];  /* buffer being received into */
+static uint16_t g_page_addr = NO_PAGE;  /* flash page mirrored in g_page */
+static uint8_t g_page_dirty;            /* g_page differs from flash */
+static uint16_t g_page_writes;          /* pages programmed this session */
+
+typedef enum {
+  FS_Idle,
+  FS_Erasing,
+  FS_Writing,
+} FlashState;
+
+/**
+ * A page handed to the flash engine.  Pages sent with 'P' are acknowledged
+ * with their sequence number once they are programmed.
+ */
+typedef struct {
+  uint8_t*  data;       /* RAM copy, or 0 once it is in the SPM buffer */
+  uint16_t  address;
+  uint8_t   ack;        /* send BOOT_ACK and seq when programmed */
+  uint8_t   seq;
+  uint8_t   blank;      /* only erase the page, leaving it 0xFF */
+} FlashJob;
+
+static FlashState g_flash_state = FS_Idle;
+static FlashJob g_flash_job;      /* page being erased or written */
+static FlashJob g_flash_queued;   /* page waiting for the engine */
+
+/**
+ * Advance the flash engine without blocking.  Call this whenever the
+ * bootloader would otherwise spin, so that erasing and writing a page
+ * overlaps with receiving the next one.
+ */
+static void flash_poll(void) {
+  if (boot_hal_flash_busy()) {
+    return;
+  }
+
+  switch (g_flash_state) {
+  case FS_Erasing:
+    if (!g_flash_job.blank) {
+      boot_hal_page_write(g_flash_job.address);
+      g_flash_state = FS_Writing;
+      break;
+    }
+    /* An erased page is already blank. */
+    /* fall through */
+  case FS_Writing:
+    /* Blank pages were only erased, so don't count them as programmed. */
+    if (FS_Writing == g_flash_state) {
+      ++g_page_writes;
+    }
+    if (g_flash_job.ack) {
+      boot_hal_transmit(BOOT_ACK);
+      boot_hal_transmit(g_flash_job.seq);
+    }
+    g_flash_state = FS_Idle;
+    /* fall through */
+  case FS_Idle:
+    if (g_flash_queued.data) {
+      g_flash_job = g_flash_queued;
+
+      /* Fill the SPM page buffer first; that frees the RAM copy. */
+      if (!g_flash_job.blank) {
+        for (uint8_t i = 0; i < SPM_PAGESIZE; i += 2) {
+          uint16_t word = g_flash_job.data[i] | g_flash_job.data[i+1] << 8;
+          boot_hal_page_fill(g_flash_job.address+i, word);
+        }
+      }
+      g_flash_queued.data = 0;
+
+      boot_hal_page_erase(g_flash_job.address);
+      g_flash_state = FS_Erasing;
+    }
+    break;
+  }
+}
+
+/**
+ * Wait until every queued page has been programmed.
+ */
+static void flash_sync(void) {
+  while (g_flash_queued.data || FS_Idle != g_flash_state) {
+    flash_poll();
+  }
+}
+
+/**
+ * Hand g_page to the flash engine to be programmed at page_addr, and
+ * switch g_page to the free buffer.
+ */
+static void flash_queue_page(uint16_t page_addr, uint8_t ack, uint8_t seq) {
+  while (g_flash_queued.data) {
+    flash_poll();
+  }
+
+  g_flash_queued.address = page_addr;
+  g_flash_queued.ack = ack;
+  g_flash_queued.seq = seq;
+  g_flash_queued.blank = 0;
+  g_flash_queued.data = g_page;
+
+  g_page = g_page == g_buffers[0] ? g_buffers[1] : g_buffers[0];
+  g_page_addr = NO_PAGE;
+  g_page_dirty = 0;
+
+  flash_poll();
+}
+
+/**
+ * Hand the flash engine a page to erase and leave blank, acknowledging it
+ * with seq.  This takes no RAM buffer: data only marks the job queued.
+ */
+static void flash_queue_blank(uint16_t page_addr, uint8_t seq) {
+  while (g_flash_queued.data) {
+    flash_poll();
+  }
+
+  g_flash_queued.address = page_addr;
+  g_flash_queued.ack = 1;
+  g_flash_queued.seq = seq;
+  g_flash_queued.blank = 1;
+  g_flash_queued.data = g_page;
+
+  flash_poll();
+}
+
+/**
+ * Program g_page into flash if any record changed it since it was loaded.
+ */
+static void flash_commit_page(void) {
+  if (g_page_dirty) {
+    flash_queue_page(g_page_addr, 0, 0);
+  }
+}
+
+/**
+ * Program any pending page and make the application section readable.
+ */
+static void flash_readable(void) {
+  flash_commit_page();
+
+  /*
+   * The RWW section can't be read until the last write has finished, and
+   * re-enabling it clears the SPM page buffer, so nothing may be pending.
+   */
+  flash_sync();
+  boot_hal_rww_enable();
+}
+
+/**
+ * Make g_page mirror the flash page at page_addr, committing whatever page
+ * it held before.  Loading the current contents first means bytes that no
+ * record touches survive the page being reprogrammed.
+ */
+static void flash_load_page(uint16_t page_addr) {
+  if (page_addr == g_page_addr) {
+    return;
+  }
+  flash_readable();
+  for (uint8_t i = 0; i < SPM_PAGESIZE; ++i) {
+    g_page[i] = boot_hal_read_flash(page_addr + i);
+  }
+  g_page_addr = page_addr;
+}
+
+/**
+ * Receive a byte, keeping the flash engine busy while we wait for it.
+ */
+static uint8_t boot_receive(void) {
+  while (!boot_hal_received()) {
+    flash_poll();
+  }
+  return boot_hal_receive();
+}
+
+/**
+ * Receive a byte and fold it into a running CRC-16/XMODEM.  Since the
+ * sender appends its CRC big-endian, the CRC over a whole intact frame,
+ * including the trailing CRC, is 0.
+ */
+static uint8_t boot_receive_crc16(uint16_t* crc16) {
+  uint8_t data = boot_receive();
+  *crc16 = boot_hal_crc16_update(*crc16, data);
+  return data;
+}
+
+/**
+ * Get back in step with the host after a damaged frame or an unknown
+ * command.  Once a byte is lost, the rest of what the host sent would be
+ * taken for commands, so acknowledge every page already accepted, then
+ * throw input away until the line has been quiet for BOOT_QUIET_MS.  The
+ * BOOT_NACK or '?' sent after this tells the host to resend everything
+ * not yet acknowledged.
+ */
+static void boot_resync(void) {
+  uint8_t data;
+  do {
+    flash_sync();
+  } while (boot_hal_receive_timeout(&data, BOOT_QUIET_MS));
+}
+
+/**
+ * Receive a run-length encoded page into g_page.  The code is a length
+ * byte and that many bytes of runs, each starting with a control byte c:
+ * below 0x80, c + 1 literal bytes follow; otherwise one byte follows, to
+ * be repeated c - 0x80 + 3 times.  Nothing is written beyond g_page, so a
+ * damaged frame is still read to its end.
+ * @return 1 if the runs filled exactly one page.
+ */
+static uint8_t boot_receive_rle(uint16_t* crc16) {
+  uint8_t length = boot_receive_crc16(crc16);
+  uint16_t fill = 0;      /* bytes of the page decoded so far */
+  uint8_t literal = 0;    /* literal bytes still to come */
+  uint8_t repeat = 0;     /* copies to make of the next byte */
+
+  for (; length; --length) {
+    uint8_t data = boot_receive_crc16(crc16);
+    if (literal) {
+      --literal;
+      if (fill < SPM_PAGESIZE) {
+        g_page[fill] = data;
+      }
+      ++fill;
+    } else if (repeat) {
+      for (; repeat; --repeat, ++fill) {
+        if (fill < SPM_PAGESIZE) {
+          g_page[fill] = data;
+        }
+      }
+    } else if (data & 0x80) {
+      repeat = data - 0x80 + 3;
+    } else {
+      literal = data + 1;
+    }
+  }
+
+  return SPM_PAGESIZE == fill && !literal && !repeat;
+}
+
+/* Session state carried from one command to the next. */
+static uint8_t g_crc;             /* running sum for the 'L', 'A', 'D' protocol */
+static IntelHexRecordHeader g_ihex = { 0x00, 0x0000 };
+static uint8_t g_seq;             /* sequence number expected in the next 'P' frame */
+
+uint8_t boot_command(void) {
+  uint8_t command = boot_receive();
+
+  switch (command) {
+  case 'A': /* Set ihex address. */
+    g_ihex.address = boot_receive() << 8;
+    g_crc += g_ihex.address >> 8;
+
+    g_ihex.address |= boot_receive();
+    g_crc += g_ihex.address & 0xFF;
+
+    boot_hal_transmit((g_ihex.address >> 8) + (g_ihex.address & 0xFF));
+
+    boot_hal_wdt_reset();
+    break;
+  case 'L': /* Set data length. */
+    g_crc += g_ihex.length = boot_receive();
+    boot_hal_transmit(g_ihex.length);
+    boot_hal_wdt_reset();
+    break;
+  case 'D': /* Write data.  Return CRC. */ {
+    /*
+     * Records accumulate in g_page, which is only programmed once the
+     * data moves on to another page or the upload ends.
+     */
+    uint16_t addr = g_ihex.address;
+    for (uint8_t i = 0; i < g_ihex.length; ++i, ++addr) {
+      flash_load_page(PAGE_ADDR_BASE(addr));
+
+      g_crc += g_page[PAGE_OFFSET(addr)] = boot_receive();
+      g_page_dirty = 1;
+      boot_hal_transmit(g_page[PAGE_OFFSET(addr)]);
+
+      boot_hal_wdt_reset();
+    }
+
+    boot_hal_transmit(~g_crc + 1);
+    g_crc = 0;
+
+    boot_hal_wdt_reset();
+    break;
+  }
+  case 'I': /* Report bootloader information; restart 'P' sequencing. */ {
+    uint16_t rates = 0;   /* bit n: boot_baud_ubrr(n) is offered */
+    for (uint8_t i = 0; i < BOOT_BAUD_COUNT; ++i) {
+      if (NO_UBRR != boot_baud_ubrr(i)) {
+        rates |= 1 << i;
+      }
+    }
+
+    boot_hal_transmit(BOOT_INFO_LENGTH);
+    boot_hal_transmit(BOOT_PROTOCOL_VERSION);
+    boot_hal_transmit(SPM_PAGESIZE >> 8);
+    boot_hal_transmit(SPM_PAGESIZE & 0xFF);
+    boot_hal_transmit(BOOT_PAGE_BUFFERS);
+    boot_hal_transmit(boot_hal_app_size() >> 8);
+    boot_hal_transmit(boot_hal_app_size() & 0xFF);
+    boot_hal_transmit((uint32_t)(F_CPU) >> 24);
+    boot_hal_transmit(((uint32_t)(F_CPU) >> 16) & 0xFF);
+    boot_hal_transmit(((uint32_t)(F_CPU) >> 8) & 0xFF);
+    boot_hal_transmit((uint32_t)(F_CPU) & 0xFF);
+    boot_hal_transmit(rates >> 8);
+    boot_hal_transmit(rates & 0xFF);
+    g_seq = 0;
+    boot_hal_wdt_reset();
+    break;
+  }
+  case 'S': /* Switch baud rate.  Return BOOT_ACK at each rate, or BOOT_NACK. */ {
+    /*
+     * Request: the number of the rate (see boot_baud_ubrr()) and its
+     * complement.  BOOT_ACK goes out at the old rate, then the UART
+     * switches and waits BOOT_PROBE_MS for BOOT_PROBE at the new one,
+     * which it answers with BOOT_ACK.  Anything else, or nothing, puts
+     * the UART back at its configured rate, where the host looks for it
+     * after a failed probe.
+     */
+    uint8_t index = boot_receive();
+    uint8_t check = boot_receive();
+    uint16_t ubrr = boot_baud_ubrr(index);
+    if ((uint8_t)~index != check || NO_UBRR == ubrr) {
+      boot_hal_transmit(BOOT_NACK);
+      break;
+    }
+
+    /* Pages acknowledge themselves, so finish them at the old rate. */
+    flash_commit_page();
+    flash_sync();
+    boot_hal_transmit(BOOT_ACK);
+    boot_hal_set_ubrr(ubrr);
+
+    uint8_t probe;
+    if (boot_hal_receive_timeout(&probe, BOOT_PROBE_MS) && BOOT_PROBE == probe) {
+      boot_hal_transmit(BOOT_ACK);
+    } else {
+      boot_hal_reset_baud();
+    }
+    boot_hal_wdt_reset();
+    break;
+  }
+  case 'P': /* Write a whole page.  Return status and sequence number. */
+  case 'Z': /* Write a run-length encoded page.  Likewise. */
+  case 'B': /* Erase a page, leaving it blank.  Likewise. */ {
+    /*
+     * Frame: sequence number, address (2 bytes, big-endian, page
+     * aligned), the page, then the CRC-16/XMODEM of all of the above.
+     * 'P' sends the page as SPM_PAGESIZE bytes, 'Z' as run-length code
+     * (see boot_receive_rle()), and 'B' not at all: the page is only
+     * erased, which also saves programming it.
+     *
+     * A good frame is queued and acknowledged with BOOT_ACK and its
+     * sequence number once it has been programmed.  A corrupt or
+     * out-of-order frame is answered, after boot_resync(), with BOOT_NACK
+     * and the sequence number expected instead, and the host resends from
+     * there.
+     */
+    flash_commit_page();
+    g_page_addr = NO_PAGE;
+
+    uint16_t crc16 = 0;
+    uint8_t frame_seq = boot_receive_crc16(&crc16);
+    uint16_t addr = boot_receive_crc16(&crc16) << 8;
+    addr |= boot_receive_crc16(&crc16);
+    uint8_t decoded = 1;
+    if ('P' == command) {
+      for (uint8_t i = 0; i < SPM_PAGESIZE; ++i) {
+        g_page[i] = boot_receive_crc16(&crc16);
+      }
+    } else if ('Z' == command) {
+      decoded = boot_receive_rle(&crc16);
+    }
+    boot_receive_crc16(&crc16);
+    boot_receive_crc16(&crc16);
+
+    if (decoded && 0 == crc16 && frame_seq == g_seq && 0 == PAGE_OFFSET(addr)) {
+      if ('B' == command) {
+        flash_queue_blank(addr, g_seq++);
+      } else {
+        flash_queue_page(addr, 1, g_seq++);
+      }
+    } else {
+      boot_resync();
+      boot_hal_transmit(BOOT_NACK);
+      boot_hal_transmit(g_seq);
+    }
+
+    boot_hal_wdt_reset();
+    break;
+  }
+  case 'C': /* Report the CRC of each page in a run of flash pages. */ {
+    /*
+     * Request: address (2 bytes, big-endian, page aligned) and a page
+     * count.  The CRC-16/XMODEM of each page's flash contents comes back
+     * big-endian, so the host need only send the pages that differ.
+     */
+    uint16_t addr = boot_receive() << 8;
+    addr |= boot_receive();
+    uint8_t count = boot_receive();
+
+    flash_readable();
+    for (addr = PAGE_ADDR_BASE(addr); count; --count, addr += SPM_PAGESIZE) {
+      uint16_t crc16 = 0;
+      for (uint16_t i = 0; i < SPM_PAGESIZE; ++i) {
+        crc16 = boot_hal_crc16_update(crc16, boot_hal_read_flash(addr + i));
+      }
+      boot_hal_transmit(crc16 >> 8);
+      boot_hal_transmit(crc16 & 0xFF);
+      boot_hal_wdt_reset();
+    }
+    break;
+  }
+  case 'R': /* Read a run of flash pages, each followed by a running CRC. */ {
+    /*
+     * Request: address (2 bytes, big-endian, page aligned) and a page
+     * count.  Each page's flash contents come back followed by the
+     * CRC-16/XMODEM, big-endian, of every byte sent so far, so the host
+     * can tell which page was the first to arrive damaged.
+     */
+    uint16_t addr = boot_receive() << 8;
+    addr |= boot_receive();
+    uint8_t count = boot_receive();
+
+    flash_readable();
+    uint16_t crc16 = 0;
+    for (addr = PAGE_ADDR_BASE(addr); count; --count, addr += SPM_PAGESIZE) {
+      for (uint16_t i = 0; i < SPM_PAGESIZE; ++i) {
+        uint8_t data = boot_hal_read_flash(addr + i);
+        crc16 = boot_hal_crc16_update(crc16, data);
+        boot_hal_transmit(data);
+      }
+      boot_hal_transmit(crc16 >> 8);
+      boot_hal_transmit(crc16 & 0xFF);
+      boot_hal_wdt_reset();
+    }
+    break;
+  }
+  case 'E': /* End upload; report page writes; start program. */
+    flash_commit_page();
+    flash_sync();
+    boot_hal_transmit(g_page_writes >> 8);
+    boot_hal_transmit(g_page_writes & 0xFF);
+    return 0;
+  default:
+    boot_resync();
+    boot_hal_transmit('?');
+    g_crc = 0;
+    break;
+  }
+
+  return 1;
+}
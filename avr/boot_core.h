@@ -0,0 +1,207 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ *
+ * The bootloader's command handling, kept apart from the hardware so that
+ * it builds for the host as well.  boot_core.c only touches the UART, the
+ * flash and the watchdog through the boot_hal_*() functions below.  On an
+ * AVR they wrap avr-libc directly; anywhere else the program linking
+ * boot_core.c must define them and SPM_PAGESIZE (see pc/bootsim.c).
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Bumped whenever a command is added or changes its wire format.
+ * Reported as the first byte of the 'I' response.
+ */
+#define BOOT_PROTOCOL_VERSION 7
+
+/**
+ * @brief Receive one command from the host and carry it out.
+ * @return 0 once 'E' has ended the upload and every page is programmed,
+ * 1 otherwise.
+ */
+uint8_t boot_command(void);
+
+#ifdef __AVR__
+
+#include <avr/boot.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+#include "uart.h"
+
+static inline uint8_t boot_hal_received(void) {
+  return uart0_receive_buffer_full();
+}
+
+static inline uint8_t boot_hal_receive(void) {
+  return uart0_receive();
+}
+
+static inline void boot_hal_transmit(uint8_t data) {
+  uart0_transmit(data);
+}
+
+static inline uint8_t boot_hal_receive_timeout(uint8_t* data, uint16_t timeout_ms) {
+  return uart0_receive_timeout(data, timeout_ms);
+}
+
+static inline void boot_hal_set_ubrr(uint16_t ubrr) {
+  uart0_set_ubrr(ubrr, 1);
+}
+
+static inline void boot_hal_reset_baud(void) {
+  uart0_set_ubrr(UART0_UBRR_VALUE, UART0_USE_2X);
+}
+
+static inline uint8_t boot_hal_flash_busy(void) {
+  return boot_spm_busy();
+}
+
+/*
+ * SPM must follow the write to SPMCSR within four cycles, so none of the
+ * boot_page_*() calls may be interrupted by the UART ISRs.
+ */
+static inline void boot_hal_page_fill(uint16_t address, uint16_t word) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    boot_page_fill(address, word);
+  }
+}
+
+static inline void boot_hal_page_erase(uint16_t address) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    boot_page_erase(address);
+  }
+}
+
+static inline void boot_hal_page_write(uint16_t address) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    boot_page_write(address);
+  }
+}
+
+static inline void boot_hal_rww_enable(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    boot_rww_enable();
+  }
+}
+
+static inline uint8_t boot_hal_read_flash(uint16_t address) {
+  return pgm_read_byte(address);
+}
+
+/* BOOT_START is where the bootloader's section begins; see CMakeLists.txt. */
+static inline uint16_t boot_hal_app_size(void) {
+  return BOOT_START;
+}
+
+static inline uint16_t boot_hal_crc16_update(uint16_t crc, uint8_t data) {
+  return _crc_xmodem_update(crc, data);
+}
+
+static inline void boot_hal_wdt_reset(void) {
+  wdt_reset();
+}
+
+#else
+
+/**
+ * @brief Whether a received byte is waiting to be read.
+ */
+uint8_t boot_hal_received(void);
+
+/**
+ * @brief Read a received byte; only called once one is waiting.
+ */
+uint8_t boot_hal_receive(void);
+
+/**
+ * @brief Send a byte to the host, waiting for room if need be.
+ */
+void boot_hal_transmit(uint8_t data);
+
+/**
+ * @brief Read a received byte, giving up after about "timeout_ms".
+ * @return 1 if a byte was read into "data", 0 on timeout.
+ */
+uint8_t boot_hal_receive_timeout(uint8_t* data, uint16_t timeout_ms);
+
+/**
+ * @brief Once everything sent has left, run the UART at double speed
+ * (U2X0) with this UBRR value, F_CPU / (8 * (ubrr + 1)) baud.
+ */
+void boot_hal_set_ubrr(uint16_t ubrr);
+
+/**
+ * @brief Once everything sent has left, put the UART back at the rate it
+ * was configured with.
+ */
+void boot_hal_reset_baud(void);
+
+/**
+ * @brief Whether the last page erase or write is still in progress.
+ */
+uint8_t boot_hal_flash_busy(void);
+
+/**
+ * @brief Store a little-endian word in the temporary page buffer.
+ */
+void boot_hal_page_fill(uint16_t address, uint16_t word);
+
+/**
+ * @brief Start erasing the flash page holding "address".
+ */
+void boot_hal_page_erase(uint16_t address);
+
+/**
+ * @brief Start programming the temporary page buffer into the flash page
+ * holding "address".
+ */
+void boot_hal_page_write(uint16_t address);
+
+/**
+ * @brief Make the application section readable again after programming,
+ * which clears the temporary page buffer.
+ */
+void boot_hal_rww_enable(void);
+
+/**
+ * @brief Read a byte of the application section.
+ */
+uint8_t boot_hal_read_flash(uint16_t address);
+
+/**
+ * @brief Bytes of flash below the bootloader, which it may program.
+ */
+uint16_t boot_hal_app_size(void);
+
+/**
+ * @brief Fold a byte into a running CRC-16/XMODEM.
+ */
+uint16_t boot_hal_crc16_update(uint16_t crc, uint8_t data);
+
+/**
+ * @brief Keep the watchdog from resetting the bootloader.
+ */
+void boot_hal_wdt_reset(void);
+
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -20,6 +20,12 @@ extern "C" {
 #define PWM_MIN_US 500U   // 1ms with Phase Correct PWM
 #define PWM_MAX_US 1000U  // 2ms with Phase Correct PWM
 
+#define SERVO_CHANNELS 2  // Timer 1 drives OC1A and OC1B
+
+/* Compare values for the 0 and 180 degree positions. */
+#define SERVO_TICKS_MIN us_clocks(PWM_MIN_US, Prescaled_8)
+#define SERVO_TICKS_MAX us_clocks(PWM_MAX_US, Prescaled_8)
+
 /**
  * Generate PWM duty cycle for servo positions between 0 and 180 degrees.
  * Assumes a duty cycle of 1ms for the 0 degree position and
@@ -12,17 +12,157 @@
  */
 
 #include <stdio.h>
+#include <avr/interrupt.h>
 #include <avr/io.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#if 100UL * UART0_BAUD_ERROR(UART0_UBRR_VALUE, UART0_USE_2X ? 8UL : 16UL) > \
+  (BAUD) * (BAUD_TOL)
+#  error BAUD is out of BAUD_TOL percent at this F_CPU; pick another ./configure -baud
+#endif
+
+#if UART0_RX_BUFFER_SIZE & (UART0_RX_BUFFER_SIZE - 1) || UART0_RX_BUFFER_SIZE > 256
+#  error UART0_RX_BUFFER_SIZE must be a power of 2 no larger than 256
+#endif
+
+#if UART0_TX_BUFFER_SIZE & (UART0_TX_BUFFER_SIZE - 1) || UART0_TX_BUFFER_SIZE > 256
+#  error UART0_TX_BUFFER_SIZE must be a power of 2 no larger than 256
+#endif
+
+static volatile uint16_t rx_overruns;
+static volatile uint8_t tx_started;  /* TXC0 is meaningful once something was sent */
+static uint16_t tx_dropped;
+static UARTTxPolicy tx_policy = UTP_Block;
+
+static inline void rx_overrun(void) {
+  if (rx_overruns != 0xFFFF) {
+    ++rx_overruns;
+  }
+}
+
+#if UART0_RX_BUFFER_SIZE
+#  define RX_MASK (UART0_RX_BUFFER_SIZE - 1)
+
+/*
+ * The ISR only moves rx_head and the readers only move rx_tail, so neither
+ * side needs to block the other.  One slot stays empty to tell a full
+ * buffer from an empty one.
+ */
+static volatile uint8_t rx_buffer[UART0_RX_BUFFER_SIZE];
+static volatile uint8_t rx_head;
+static volatile uint8_t rx_tail;
+
+ISR(USART_RX_vect) {
+  uint8_t status = UCSR0A;
+  uint8_t data = UDR0;
+  if (status & _BV(DOR0)) {
+    rx_overrun();
+  }
+
+  uint8_t head = (rx_head + 1) & RX_MASK;
+  if (head == rx_tail) {
+    rx_overrun();
+  } else {
+    rx_buffer[rx_head] = data;
+    rx_head = head;
+  }
+}
+#endif
+
+/**
+ * Start sending a character; UDR0 must be empty.
+ */
+static inline void tx_put(uint8_t data) {
+  /* Clear TXC0 (by writing a 1) so it marks the end of this character. */
+  UCSR0A = (UCSR0A & (_BV(U2X0) | _BV(MPCM0))) | _BV(TXC0);
+  UDR0 = data;
+  tx_started = 1;
+}
+
+#if UART0_TX_BUFFER_SIZE
+#  define TX_MASK (UART0_TX_BUFFER_SIZE - 1)
+
+/*
+ * Writers only move tx_head and the ISR only moves tx_tail.  UDRIE0 stays
+ * set for as long as the buffer holds anything.
+ */
+static volatile uint8_t tx_buffer[UART0_TX_BUFFER_SIZE];
+static volatile uint8_t tx_head;
+static volatile uint8_t tx_tail;
+
+/**
+ * Move the oldest buffered character to UDR0, or stop the UDRE interrupt
+ * once there is nothing left.
+ */
+static inline void tx_next(void) {
+  uint8_t tail = tx_tail;
+  if (tail == tx_head) {
+    UCSR0B &= ~_BV(UDRIE0);
+  } else {
+    tx_put(tx_buffer[tail]);
+    tx_tail = (tail + 1) & TX_MASK;
+  }
+}
+
+ISR(USART_UDRE_vect) {
+  tx_next();
+}
+
+static inline uint8_t tx_full(void) {
+  return ((tx_head + 1) & TX_MASK) == tx_tail;
+}
+
+static inline uint8_t tx_empty(void) {
+  return tx_head == tx_tail;
+}
+
+static inline void tx_push(uint8_t data) {
+  tx_buffer[tx_head] = data;
+  tx_head = (tx_head + 1) & TX_MASK;
+  UCSR0B |= _BV(UDRIE0);
+}
+
+/**
+ * Make progress while waiting for room.  With interrupts disabled, the
+ * ISR can't run, so feed UDR0 ourselves instead of waiting forever.
+ */
+static inline void tx_wait(void) {
+  if (!(SREG & _BV(SREG_I)) && (UCSR0A & _BV(UDRE0))) {
+    tx_next();
+  }
+}
+#else
+static inline uint8_t tx_full(void) {
+  return (UCSR0A & _BV(UDRE0)) == 0;
+}
+
+static inline uint8_t tx_empty(void) {
+  return 1;
+}
+
+static inline void tx_push(uint8_t data) {
+  tx_put(data);
+}
+
+static inline void tx_wait(void) {
+}
+#endif
 
 static int uart0_putchar(char c, FILE* stream);
 static FILE mystdout = FDEV_SETUP_STREAM(uart0_putchar, NULL, _FDEV_SETUP_WRITE);
 
 int uart0_putchar(char c, FILE* stream) {
   if ('\n' == c) {
-    uart0_putchar('\r', stream);
+    if (0 != uart0_putchar('\r', stream)) {
+      return -1;
+    }
   }
 
-  uart0_transmit(c);
+  /* Only UTP_Report makes a full buffer an error for stdio. */
+  if (!uart0_transmit(c) && UTP_Report == tx_policy) {
+    return -1;
+  }
   return 0;
 }
 
@@ -31,14 +171,23 @@ void uart0_setup_stdout() {
 }
 
 void uart0_enable(UARTMode syncMode) {
-  static uint16_t baudrate = ((F_CPU / 16 / BAUD) - 1);
-  UBRR0H = baudrate >> 8;
-  UBRR0L = baudrate;
+  UBRR0H = UART0_UBRR_VALUE >> 8;
+  UBRR0L = UART0_UBRR_VALUE & 0xFF;
+  UCSR0A = UART0_USE_2X ? _BV(U2X0) : 0;
 
   (void)UDR0; // clear any data currently in the buffer
+  rx_overruns = 0;
 
   // Set RX/TN enabled
   UCSR0B |= _BV(TXEN0) | _BV(RXEN0);
+#if UART0_RX_BUFFER_SIZE
+  rx_head = rx_tail = 0;
+  UCSR0B |= _BV(RXCIE0);
+#endif
+#if UART0_TX_BUFFER_SIZE
+  tx_head = tx_tail = 0;
+#endif
+  tx_dropped = 0;
 
   // Set frame format: 8-bit data, 1 stop bit
   UCSR0C |= _BV(UCSZ01) | _BV(UCSZ00);
@@ -54,18 +203,127 @@ void uart0_enable(UARTMode syncMode) {
   }
 }
 
-void uart0_transmit(uint8_t data) {
-  while ((UCSR0A & _BV(UDRE0)) == 0);
-  UDR0 = data;
+void uart0_set_tx_policy(UARTTxPolicy policy) {
+  tx_policy = policy;
+}
+
+uint8_t uart0_transmit(uint8_t data) {
+  while (tx_full()) {
+    if (UTP_Block != tx_policy) {
+      if (UTP_Drop == tx_policy && tx_dropped != 0xFFFF) {
+        ++tx_dropped;
+      }
+      return 0;
+    }
+    tx_wait();
+  }
+
+  tx_push(data);
+  return 1;
+}
+
+void uart0_flush(void) {
+  while (!tx_empty()) {
+    tx_wait();
+  }
+  if (tx_started) {
+    while ((UCSR0A & _BV(TXC0)) == 0);
+  }
+}
+
+uint16_t uart0_tx_dropped(void) {
+  uint16_t dropped;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    dropped = tx_dropped;
+  }
+  return dropped;
+}
+
+void uart0_disable(void) {
+  /* Let the last character leave before turning the transmitter off. */
+  uart0_flush();
+  UCSR0B = 0;
+  tx_started = 0;
+}
+
+void uart0_set_ubrr(uint16_t ubrr, uint8_t double_speed) {
+  uart0_flush();
+  UBRR0H = ubrr >> 8;
+  UBRR0L = ubrr & 0xFF;
+  UCSR0A = double_speed ? _BV(U2X0) : 0;
+}
+
+uint8_t uart0_receive_buffer_full(void) {
+  return uart0_available() != 0;
 }
 
+#if UART0_RX_BUFFER_SIZE
+uint8_t uart0_available(void) {
+  return (rx_head - rx_tail) & RX_MASK;
+}
+
+uint8_t uart0_try_receive(uint8_t* data) {
+  uint8_t tail = rx_tail;
+  if (tail == rx_head) {
+    return 0;
+  }
+
+  *data = rx_buffer[tail];
+  rx_tail = (tail + 1) & RX_MASK;
+  return 1;
+}
+#else
+uint8_t uart0_available(void) {
+  return (UCSR0A & _BV(RXC0)) != 0;
+}
+
+uint8_t uart0_try_receive(uint8_t* data) {
+  uint8_t status = UCSR0A;
+  if (!(status & _BV(RXC0))) {
+    return 0;
+  }
+
+  if (status & _BV(DOR0)) {
+    rx_overrun();
+  }
+  *data = UDR0;
+  return 1;
+}
+#endif
+
 uint8_t uart0_receive(void) {
-  while (!(UCSR0A & _BV(RXC0)));
-  return UDR0;
+  uint8_t data;
+  while (!uart0_try_receive(&data));
+  return data;
+}
+
+uint8_t uart0_receive_timeout(uint8_t* data, uint16_t timeout_ms) {
+  /* Check every 10us; the loop overhead makes the timeout a bit long. */
+  for (uint32_t ticks = (uint32_t)timeout_ms * 100; ticks; --ticks) {
+    if (uart0_try_receive(data)) {
+      return 1;
+    }
+    _delay_us(10);
+  }
+  return uart0_try_receive(data);
+}
+
+uint16_t uart0_rx_overruns(void) {
+  uint16_t overruns;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    overruns = rx_overruns;
+  }
+  return overruns;
 }
 
-void uart0_write(uint8_t* data, uint8_t length) {
+uint8_t uart0_write(uint8_t* data, uint8_t length) {
+  uint8_t queued = 0;
   for (uint8_t i = 0; i < length; ++i) {
-    uart0_transmit(data[i]);
+    if (uart0_transmit(data[i])) {
+      ++queued;
+    } else if (UTP_Report == tx_policy) {
+      break;
+    }
   }
+  return queued;
 }
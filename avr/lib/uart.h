@@ -18,18 +18,98 @@ extern "C" {
 #include <avr/io.h>
 #include <util/setbaud.h>
 
+/**
+ * Baud rate produced by a UBRR value, with a clock divisor of 16 for normal
+ * speed or 8 for double speed (U2X0).
+ */
+#define UART0_ACTUAL_BAUD(ubrr, divisor) ((F_CPU) / ((divisor) * ((ubrr) + 1UL)))
+
+/**
+ * Distance between BAUD and the rate a UBRR value produces.
+ */
+#define UART0_BAUD_ERROR(ubrr, divisor)                         \
+  (UART0_ACTUAL_BAUD(ubrr, divisor) > (BAUD)                    \
+   ? UART0_ACTUAL_BAUD(ubrr, divisor) - (BAUD)                  \
+   : (BAUD) - UART0_ACTUAL_BAUD(ubrr, divisor))
+
+/*
+ * <util/setbaud.h> only turns to double speed once normal speed is out of
+ * BAUD_TOL.  Double speed halves the divisor, so it also wins whenever its
+ * UBRR lands strictly closer to BAUD (e.g. 1M baud at 8 MHz, or 57600 at
+ * 16 MHz).  Normal speed is kept on ties, since it samples each bit more.
+ */
+#define UART0_UBRR_2X (((F_CPU) + 4UL * (BAUD)) / (8UL * (BAUD)) - 1UL)
+
+#if USE_2X
+#  define UART0_USE_2X 1
+#  define UART0_UBRR_VALUE UBRR_VALUE
+#elif (F_CPU) >= 8UL * (BAUD) && UART0_UBRR_2X <= 0xFFF && \
+  UART0_BAUD_ERROR(UART0_UBRR_2X, 8UL) < UART0_BAUD_ERROR(UBRR_VALUE, 16UL)
+#  define UART0_USE_2X 1
+#  define UART0_UBRR_VALUE UART0_UBRR_2X
+#else
+#  define UART0_USE_2X 0
+#  define UART0_UBRR_VALUE UBRR_VALUE
+#endif
+
+/**
+ * Size of the interrupt-driven receive ring buffer, in bytes.  When 0 (the
+ * default), reception is polled and only the two-byte hardware FIFO
+ * buffers incoming data.  Otherwise it must be a power of 2 no larger than
+ * 256, and the program must call sei() after {@see uart0_enable}.
+ *
+ * This has to match between the io library and the program using it; the
+ * build takes care of that through target_link_io().
+ */
+#ifndef UART0_RX_BUFFER_SIZE
+#  define UART0_RX_BUFFER_SIZE 0
+#endif
+
+/**
+ * Size of the interrupt-driven transmit ring buffer, in bytes.  When 0 (the
+ * default), every character waits for the previous one to leave UDR0.
+ * Otherwise, the same rules as {@see UART0_RX_BUFFER_SIZE} apply.
+ */
+#ifndef UART0_TX_BUFFER_SIZE
+#  define UART0_TX_BUFFER_SIZE 0
+#endif
+
 typedef enum {
   UM_Asynchronous,
   UM_Synchronous,
   UM_MasterSPI,
 } UARTMode;
 
+/**
+ * What to do when a character is sent while the transmit buffer (or UDR0,
+ * without one) is full.
+ */
+typedef enum {
+  UTP_Block,    /* wait for room; the default */
+  UTP_Drop,     /* discard the character and count it as dropped */
+  UTP_Report,   /* keep the character and let the caller retry it */
+} UARTTxPolicy;
+
 /**
  * @brief Enables the UART device for 8-bit data at
  * the specified {@see BAUD}.
  */
 void uart0_enable(UARTMode syncMode);
 
+/**
+ * @brief Disables the UART device, along with its interrupts, so that a
+ * program jumped to afterwards finds it in its reset state.
+ */
+void uart0_disable(void);
+
+/**
+ * @brief Change the baud rate of the enabled UART, once every queued
+ * character has left at the old rate.
+ * @param ubrr UBRR0 value for the new rate.
+ * @param double_speed Non-zero to halve the clock divisor (U2X0).
+ */
+void uart0_set_ubrr(uint16_t ubrr, uint8_t double_speed);
+
 /**
  * @brief Setup stdout to "print" through the serial port,
  * making functions like printf(3) go through serial.
@@ -37,17 +117,42 @@ void uart0_enable(UARTMode syncMode);
 void uart0_setup_stdout(void);
 
 /**
- * @brief Transmits a character through the UART device.
+ * @brief Choose how {@see uart0_transmit}, {@see uart0_write} and stdout
+ * behave when the transmit buffer is full.  Under UTP_Report, stdout
+ * reports an error when a character doesn't fit.
+ * @param policy
+ */
+void uart0_set_tx_policy(UARTTxPolicy policy);
+
+/**
+ * @brief Transmits a character through the UART device.  With a transmit
+ * buffer, this returns as soon as the character is queued.
  * @param data The data to be sent.
+ * @return 1 if the character was queued, 0 if the buffer was full and the
+ * policy isn't UTP_Block.
  */
-void uart0_transmit(uint8_t data);
+uint8_t uart0_transmit(uint8_t data);
 
 /**
  * @brief Write a series of data to the UART device.
  * @param data
  * @param length
+ * @return The number of characters queued.  Under UTP_Report, these are
+ * the first ones of "data", and the rest should be written again later.
+ */
+uint8_t uart0_write(uint8_t* data, uint8_t length);
+
+/**
+ * @brief Wait until every queued character has left the UART.
+ */
+void uart0_flush(void);
+
+/**
+ * @brief Count the characters discarded under UTP_Drop since the UART
+ * was enabled.
+ * @return The number of dropped characters, saturating at 0xFFFF.
  */
-void uart0_write(uint8_t* data, uint8_t length);
+uint16_t uart0_tx_dropped(void);
 
 /**
  * @brief Determine whether or not the UART has data for reception.
@@ -56,11 +161,42 @@ void uart0_write(uint8_t* data, uint8_t length);
 uint8_t uart0_receive_buffer_full(void);
 
 /**
- * @brief Receives a character from the UART device.
+ * @brief Receives a character from the UART device, waiting for one
+ * if necessary.
  * @return Received character from the UART.
  */
 uint8_t uart0_receive(void);
 
+/**
+ * @brief Count the characters ready to be received without waiting.
+ * @return The number of buffered characters; at most 1 when reception
+ * is polled.
+ */
+uint8_t uart0_available(void);
+
+/**
+ * @brief Receives a character from the UART device if one is ready.
+ * @param data Where to store the received character.
+ * @return 1 if a character was received, 0 otherwise.
+ */
+uint8_t uart0_try_receive(uint8_t* data);
+
+/**
+ * @brief Receives a character from the UART device, giving up after
+ * roughly "timeout_ms" milliseconds.
+ * @param data Where to store the received character.
+ * @param timeout_ms
+ * @return 1 if a character was received, 0 on timeout.
+ */
+uint8_t uart0_receive_timeout(uint8_t* data, uint16_t timeout_ms);
+
+/**
+ * @brief Count the characters lost since the UART was enabled, either
+ * because the hardware overran or because the ring buffer was full.
+ * @return The number of lost characters, saturating at 0xFFFF.
+ */
+uint16_t uart0_rx_overruns(void);
+
 
 #ifdef __cplusplus
 } // extern "C"
@@ -7,23 +7,18 @@
  * Copyright William Grim, 2015
  *
  * This program sets up a 50 Hz PWM and a basic UART command structure.
- * Users may connect to the UART and send one byte at a time to make up
- * more complex commands.  The basic layout of the command format is
- * like this: [B_1,B_2,0xFE], with the commas, brackets, and quotes all
- * being abstract (e.g. not really sent across the wire).
+ * Every command is a frame of [msgid, cmd, payload...], where the payload
+ * depends on cmd:
  *
- * B_1 will generally be the servo of interest (e.g. 'A' or 'B').
- * B_2 will generally be a byte between 0 and 180, representing degrees.
- * B_1 and B_2 may be sent interchangeably or even many times over, and the
- * AVR will just continue to record the data and echo bytes received back
- * to the sender until a COMMAND_EXEC_BYTE is reached.
+ *   'L', 'R'  degrees for OC1A or OC1B, as a big-endian 16-bit value.
+ *   'M'       degrees for every channel, one byte each, OC1A first.
+ *   'T'       compare ticks for every channel, big-endian 16 bits each,
+ *             between SERVO_TICKS_MIN and SERVO_TICKS_MAX.
+ *   'C'       a channel number, then compare ticks for just that channel.
  *
- * Bytes sent across the wire will be echoed back to the sending device,
- * except in the case when COMMAND_EXEC_BYTE (0xFE) is received.  In that
- * case, ACK_BYTE (0xFF) will be sent back to the sending device.
- *
- * In the case where the AVR thinks you are trying to set the degrees and
- * the degrees are outside the range of [0,180], it will send back a BAD_BYTE.
+ * A frame is answered with its msgid once applied, or NACK_BYTE when the
+ * command is unknown or any value is out of range, in which case none of
+ * its channels change.  Unknown commands are assumed to carry 2 bytes.
  */
 #include <inttypes.h>
 
@@ -40,8 +35,64 @@
 
 #define LEFT 'L'
 #define RIGHT 'R'
+#define MULTI 'M'
+#define TICKS 'T'
+#define CHANNEL 'C'
 
 #define CENTER_DEGREES 90
+#define MAX_DEGREES 180
+
+/* Compare registers in channel order. */
+static volatile uint16_t* const channels[SERVO_CHANNELS] = { &OCR1A, &OCR1B };
+
+static uint16_t receive16(void) {
+  uint16_t value = uart0_receive() << 8;
+  return value | uart0_receive();
+}
+
+/**
+ * @brief Receive an 'M' payload and apply it to every channel.
+ * The compare registers are buffered until the bottom of the PWM cycle, so
+ * all channels move in the same frame.
+ * @return 1 if applied, 0 if any degree was out of range.
+ */
+static uint8_t receive_degrees(void) {
+  uint8_t degrees[SERVO_CHANNELS];
+  uint8_t ok = 1;
+
+  for (uint8_t i = 0; i < SERVO_CHANNELS; ++i) {
+    degrees[i] = uart0_receive();
+    ok &= degrees[i] <= MAX_DEGREES;
+  }
+
+  if (ok) {
+    for (uint8_t i = 0; i < SERVO_CHANNELS; ++i) {
+      *channels[i] = servo(degrees[i]);
+    }
+  }
+  return ok;
+}
+
+/**
+ * @brief Receive a 'T' payload and apply it to every channel.
+ * @return 1 if applied, 0 if any tick count was out of range.
+ */
+static uint8_t receive_ticks(void) {
+  uint16_t ticks[SERVO_CHANNELS];
+  uint8_t ok = 1;
+
+  for (uint8_t i = 0; i < SERVO_CHANNELS; ++i) {
+    ticks[i] = receive16();
+    ok &= ticks[i] >= SERVO_TICKS_MIN && ticks[i] <= SERVO_TICKS_MAX;
+  }
+
+  if (ok) {
+    for (uint8_t i = 0; i < SERVO_CHANNELS; ++i) {
+      *channels[i] = ticks[i];
+    }
+  }
+  return ok;
+}
 
 int main (void) {
   servo_init(OC1A | OC1B, CENTER_DEGREES);
@@ -52,25 +103,56 @@ int main (void) {
   
   /*
    * Run a loop that receives a command and controls the servos with it.
-   * If any of the commands don't specify which servo to control, send
-   * back a NACK_BYTE; otherwise, send back the msgid.
+   *
+   * RESET_BYTE never starts a valid frame, so the sender can realign us
+   * after lost bytes by sending NUM_RESET_BYTES of them.  No payload is
+   * longer than that, so wherever the parser stands, it abandons or NACKs
+   * the partial frame and skips the rest of the run.
    */
   for (;;) {
     uint8_t msgid = uart0_receive();
+    if (RESET_BYTE == msgid) {
+      continue;
+    }
+
     uint8_t cmd = uart0_receive();
-    int16_t value = uart0_receive() << 8;
-    value |= uart0_receive();
-
-    if (LEFT == cmd) {
-      OCR1A = servo(value);
-    } else if (RIGHT == cmd) {
-      OCR1B = servo(value);
-    } else {
-      uart0_transmit(NACK_BYTE);
+    if (RESET_BYTE == cmd) {
       continue;
     }
-    
-    uart0_transmit(msgid);
+
+    uint8_t ok;
+    switch (cmd) {
+    case LEFT:
+    case RIGHT: {
+      int16_t value = receive16();
+      ok = value >= 0 && value <= MAX_DEGREES;
+      if (ok) {
+        *channels[LEFT == cmd ? 0 : 1] = servo(value);
+      }
+      break;
+    }
+    case MULTI:
+      ok = receive_degrees();
+      break;
+    case TICKS:
+      ok = receive_ticks();
+      break;
+    case CHANNEL: {
+      uint8_t channel = uart0_receive();
+      uint16_t ticks = receive16();
+      ok = channel < SERVO_CHANNELS && ticks >= SERVO_TICKS_MIN && ticks <= SERVO_TICKS_MAX;
+      if (ok) {
+        *channels[channel] = ticks;
+      }
+      break;
+    }
+    default:
+      receive16();
+      ok = 0;
+      break;
+    }
+
+    uart0_transmit(ok ? msgid : NACK_BYTE);
   }
 
   return 0;
@@ -22,12 +22,13 @@ set(CXXWARN "-Wall -Werror")
 set(CTUNING "-funsigned-char -funsigned-bitfields -fpack-struct -fshort-enums")
 set(COPT "-Os -mcall-prologues")
 
-# BAUD_TOL is set to a large value because we are going to trust the developer
-# to make a good decision, especially if they're using crystal oscillators
-# or external clocks.
+# BAUD_TOL is the error, in percent, allowed between BAUD and the rate the
+# UART can actually produce from F_CPU.  Anything worse fails the build.
+set(BAUD_TOL 2 CACHE STRING "Allowed UART baud rate error, in percent")
+
 set(
   CMAKE_C_FLAGS
-  "-mmcu=${MCU} -DF_CPU=${F_CPU} -DBAUD=${BAUD} -std=c11 ${CDEBUG} ${COPT} ${CWARN} ${CFLAGS}"
+  "-mmcu=${MCU} -DF_CPU=${F_CPU} -DBAUD=${BAUD} -DBAUD_TOL=${BAUD_TOL} -std=c11 ${CDEBUG} ${COPT} ${CWARN} ${CFLAGS}"
   CACHE STRING "")# FORCE)
 
 set(
@@ -46,7 +47,7 @@ set(
 set(FUSE -U lfuse:w:0xf7:m -U hfuse:w:0xde:m -U efuse:w:0x00:m)
 
 macro(add_avr_executable target_name srcs)
-  add_executable(${target_name} ${srcs})
+  add_executable(${target_name} ${srcs} ${ARGN})
   
   add_custom_command(TARGET ${target_name}
     POST_BUILD
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# This Source Code Form is subject to the terms of the
+# Mozilla Public License, v. 2.0.  If a copy of the MPL
+# was not distributed with this file, you can obtain one at
+# https://mozilla.org/MPL/2.0/.
+#
+# Copyright William Grim, 2015
+#
+# Usage: bootbench.sh BOOTSIM HEXUPLOADER HEXFILE BAUD MODE...
+#
+# Upload HEXFILE to a fresh bootsim once per MODE, a set of hexuploader
+# options ("-" for none), and print bootsim's report for each.  Extra
+# bootsim options, such as --rx-buffer, may be given in BOOTSIM_FLAGS.
+
+if [ $# -lt 5 ]; then
+  echo "usage: $0 BOOTSIM HEXUPLOADER HEXFILE BAUD MODE..." >&2
+  exit 1
+fi
+
+bootsim=$1
+hexuploader=$2
+hexfile=$3
+baud=$4
+shift 4
+
+if [ ! -r "$hexfile" ]; then
+  echo "$0: can't read .hex file '$hexfile'; set BENCH_HEX" >&2
+  exit 1
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+tty=$tmp/tty
+
+status=0
+for mode in "$@"; do
+  [ "$mode" = "-" ] && mode=
+
+  "$bootsim" -b "$baud" -L "$tty" $BOOTSIM_FLAGS > "$tmp/bootsim.log" 2>&1 &
+  sim=$!
+  while [ ! -e "$tty" ] && kill -0 $sim 2>/dev/null; do
+    sleep 0.1
+  done
+
+  echo "== hexuploader ${mode:-(defaults)}"
+  if ! "$hexuploader" -t "$tty" -b "$baud" -f "$hexfile" $mode > "$tmp/upload.log" 2>&1; then
+    echo "upload failed:"
+    tail -n 5 "$tmp/upload.log"
+    kill $sim 2>/dev/null
+    status=1
+  fi
+  wait $sim
+  tail -n +2 "$tmp/bootsim.log"
+  echo
+done
+
+exit $status
@@ -0,0 +1,728 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ *
+ * The bootloader on a pseudo-terminal, so hexuploader can be run and
+ * measured without an AVR.  This links the bootloader's own command
+ * handling, avr/boot_core.c, and supplies the hardware underneath it: a
+ * flash array that takes real time to erase and program, and a serial
+ * line that moves bytes no faster than the baud rate allows.
+ *
+ * Bytes from the pty arrive one byte time apart and wait in a receive
+ * buffer of --rx-buffer bytes, as in UDR0's FIFO or the UART ring buffer;
+ * any that arrive while it is full are lost, as on the real part.  Bytes
+ * sent leave one byte time apart and are written to the pty once the
+ * modelled line has finished sending them.  The 'S' command changes the
+ * modelled rate, and bytes sent faster than --line-limit arrive garbled,
+ * as over a cable that can't carry them.  --loss drops received bytes at
+ * random, to try the host's recovery.
+ *
+ * The simulator exits once the upload ends with 'E', printing what it
+ * took: time, bytes each way, page programs, and round trips, meaning
+ * the times the bootloader had answered everything and sat waiting for
+ * the host to send more.
+ */
+
+/* posix_openpt(3), cfmakeraw(3) and ppoll(2). */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <termios.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "boot_core.h"
+#include "crc16.h"
+#include "io.h"
+#include "serial.h"
+
+/* Largest application section the bootloader's 16-bit addresses reach. */
+#define FLASH_SIZE 0x10000
+
+/* Bytes read from the pty that may still be on their way in. */
+#define LINE_LEN 4096
+
+/* Bytes sent that the modelled line may still be sending. */
+#define TX_QUEUE_LEN 1024
+
+/* Bytes the modelled UART holds unread: UDR0's FIFO, or the ring buffer. */
+#if UART0_RX_BUFFER_SIZE
+#  define DEFAULT_RX_BUFFER UART0_RX_BUFFER_SIZE
+#else
+#  define DEFAULT_RX_BUFFER 2
+#endif
+
+/* Options that may be set from the command-line. */
+static uint32_t baudrate = 9600;
+static int eraseUs = 4500;
+static int writeUs = 4500;
+static unsigned rxBuffer = DEFAULT_RX_BUFFER;
+static unsigned txBuffer = 1;
+static uint32_t appSize = 0x7800;
+static uint32_t lineLimit;
+static double lossRate = 0.0;
+static unsigned seed = 1;
+
+/* The rate given with -b, which the bootloader goes back to after 'S' fails. */
+static uint32_t configuredBaud;
+static const char* linkPath = NULL;
+static const char* inputPath = NULL;
+static const char* outputPath = NULL;
+static int verbose;
+
+/* Long options without a short equivalent. */
+#define OPT_ERASE_US  0x100
+#define OPT_WRITE_US  0x101
+#define OPT_RX_BUFFER 0x102
+#define OPT_TX_BUFFER 0x103
+#define OPT_APP_SIZE  0x104
+#define OPT_LINE_LIMIT 0x105
+#define OPT_SEED      0x106
+
+void print_usage(const char *prog) {
+  printf("Usage: %s [-blLiov]\n", prog);
+  puts("  -b --baud      modelled line speed (default 9600); 0 for no pacing\n"
+       "     --erase-us  time to erase a flash page (default 4500)\n"
+       "     --write-us  time to program a flash page (default 4500)\n"
+       "     --rx-buffer bytes received that may wait unread (default 2,\n"
+       "                 the UART's FIFO, or BOOTSIM_UART_RX_BUFFER if set)\n"
+       "     --tx-buffer bytes that may wait to be sent (default 1)\n"
+       "     --app-size  bytes of flash below the bootloader (default 0x7800)\n"
+       "     --line-limit  fastest rate the modelled cable carries; bytes\n"
+       "                 sent faster arrive garbled (default: no limit)\n"
+       "  -l --loss      chance, 0 to 1, of losing each received byte (default 0)\n"
+       "     --seed      seed for the loss pattern (default 1)\n"
+       "  -L --link      also make this symlink to the pty\n"
+       "  -i --input     start with this image in the application section,\n"
+       "                 e.g. one saved with -o (default: erased flash)\n"
+       "  -o --output    write the application section here after the upload\n"
+       "  -v --verbose   print every page program\n");
+  exit(1);
+}
+
+static long parse_long(const char* name, long min, long max) {
+  char* end;
+  long val = strtol(optarg, &end, 0);
+  if ('\0' != *end || val < min || val > max) {
+    fprintf(stderr, "Invalid --%s given; must be %ld-%ld.\n", name, min, max);
+    exit(1);
+  }
+  return val;
+}
+
+void parse_opts(int argc, char *argv[]) {
+  static const struct option lopts[] = {
+    { "baud",      1, 0, 'b' },
+    { "erase-us",  1, 0, OPT_ERASE_US },
+    { "write-us",  1, 0, OPT_WRITE_US },
+    { "rx-buffer", 1, 0, OPT_RX_BUFFER },
+    { "tx-buffer", 1, 0, OPT_TX_BUFFER },
+    { "app-size",  1, 0, OPT_APP_SIZE },
+    { "line-limit", 1, 0, OPT_LINE_LIMIT },
+    { "loss",      1, 0, 'l' },
+    { "seed",      1, 0, OPT_SEED },
+    { "link",      1, 0, 'L' },
+    { "input",     1, 0, 'i' },
+    { "output",    1, 0, 'o' },
+    { "verbose",   0, 0, 'v' },
+    { NULL,        0, 0, 0 },
+  };
+
+  while (1) {
+    int c = getopt_long(argc, argv, "b:l:L:i:o:v", lopts, NULL);
+    if (-1 == c) {
+      break;
+    }
+
+    switch (c) {
+    case 'b':
+      baudrate = parse_long("baud", 0, 10000000);
+      break;
+    case OPT_ERASE_US:
+      eraseUs = parse_long("erase-us", 0, 1000000);
+      break;
+    case OPT_WRITE_US:
+      writeUs = parse_long("write-us", 0, 1000000);
+      break;
+    case OPT_RX_BUFFER:
+      rxBuffer = parse_long("rx-buffer", 1, 256);
+      break;
+    case OPT_TX_BUFFER:
+      txBuffer = parse_long("tx-buffer", 1, 256);
+      break;
+    case OPT_APP_SIZE:
+      appSize = parse_long("app-size", SPM_PAGESIZE, FLASH_SIZE - SPM_PAGESIZE);
+      break;
+    case OPT_LINE_LIMIT:
+      lineLimit = parse_long("line-limit", 1, 10000000);
+      break;
+    case 'l': {
+      char* end;
+      lossRate = strtod(optarg, &end);
+      if ('\0' != *end || lossRate < 0.0 || lossRate > 1.0) {
+        fprintf(stderr, "Invalid --loss given; must be 0-1.\n");
+        exit(1);
+      }
+      break;
+    }
+    case OPT_SEED:
+      seed = parse_long("seed", 0, UINT_MAX);
+      break;
+    case 'L':
+      linkPath = optarg;
+      break;
+    case 'i':
+      inputPath = optarg;
+      break;
+    case 'o':
+      outputPath = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (appSize % SPM_PAGESIZE) {
+    fprintf(stderr, "--app-size must be a multiple of the %u byte page size.\n",
+            SPM_PAGESIZE);
+    exit(1);
+  }
+}
+
+static struct {
+  unsigned long received;     // bytes taken off the line
+  unsigned long overruns;     // bytes lost to a full receive buffer
+  unsigned long lost;         // bytes dropped by --loss
+  unsigned long sent;
+  unsigned long commands;
+  unsigned long erases;
+  unsigned long programs;
+  unsigned long bootWrites;   // pages programmed above --app-size
+  unsigned long roundTrips;
+  unsigned long baudChanges;
+  int64_t waitUs;             // time spent waiting on the host
+  int64_t start;              // monotonic_us of the first byte
+} stats;
+
+static int master;            // our end of the pty
+static int slave;             // the host's end, held open to read its rate
+
+/* Bytes read from the pty, each due to arrive at "at". */
+static struct {
+  int64_t at;
+  uint8_t byte;
+} line[LINE_LEN];
+static unsigned lineHead;
+static unsigned lineCount;
+
+/*
+ * Bytes that have arrived but haven't been read by the bootloader.  This
+ * and the line never hold more than LINE_LEN bytes between them.
+ */
+static uint8_t rx[LINE_LEN];
+static unsigned rxHead;
+static unsigned rxCount;
+
+/*
+ * Set while the bootloader is spinning for input, when the real part would
+ * take each byte as it arrives.  Our own wakeups can run late and deliver
+ * several bytes at once, so only bytes arriving after the bootloader went
+ * off to do something else count against --rx-buffer.
+ */
+static int receiving;
+static int64_t awaySince;     // when the bootloader last stopped reading
+static unsigned rxAway;       // bytes that have arrived since then
+
+/* Bytes sent, each due to have left the modelled line at "due". */
+static struct {
+  int64_t due;
+  uint8_t byte;
+} tx[TX_QUEUE_LEN];
+static unsigned txHead;
+static unsigned txCount;
+
+/* When the modelled line is next free in each direction, in us. */
+static int64_t lineFree;
+static int64_t txFree;
+
+/* The application section, the SPM page buffer, and the flash state. */
+static uint8_t flash[FLASH_SIZE];
+static uint8_t pageBuffer[SPM_PAGESIZE];
+static int64_t flashDone;     // when the last erase or write finishes
+static int rwwBusy;           // no reads until boot_hal_rww_enable()
+
+/*
+ * Set once the bootloader has answered everything it was sent and is
+ * waiting for more, and when that started.
+ */
+static int replied;           // something was sent since the host last wrote
+static int awaiting;
+static int64_t awaitingSince;
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+/**
+ * @brief Microseconds the line takes for one byte: a start bit, 8 data
+ * bits and a stop bit.
+ */
+static int64_t byte_us(void) {
+  return baudrate ? 10 * 1000000LL / baudrate : 0;
+}
+
+static int64_t later(int64_t a, int64_t b) {
+  return a > b ? a : b;
+}
+
+/**
+ * @brief Whether the host's end of the pty is set to our rate.  Each end
+ * divides its clock to within BOOT_BAUD_TOL (1%) of the nominal rate, so
+ * two rates more than 2% apart can't frame each other's bytes.
+ */
+static int host_rate_matches(void) {
+  uint32_t hostRate;
+  if (0 == baudrate || -1 == serial_get_baudrate(slave, &hostRate)) {
+    return 1;
+  }
+  uint32_t diff = hostRate > baudrate ? hostRate - baudrate : baudrate - hostRate;
+  return 100ULL * diff <= 2ULL * baudrate;
+}
+
+/**
+ * @brief A byte as it comes off the line: garbled if the line runs faster
+ * than --line-limit, or if the two ends disagree on the rate.
+ */
+static uint8_t line_byte(uint8_t byte) {
+  if (lineLimit && baudrate > lineLimit) {
+    return byte ^ 0xFF;
+  }
+  return host_rate_matches() ? byte : 0xFF;
+}
+
+static void print_stats(void) {
+  int64_t elapsed = stats.start ? monotonic_us() - stats.start : 0;
+  double secs = elapsed / 1e6;
+  unsigned long programmed = stats.programs * SPM_PAGESIZE;
+
+  printf("\n%u baud, %u byte pages, erase %d us, write %d us\n"
+         "upload took %.3f s, %lu commands\n"
+         "%lu bytes in, %lu bytes out, %.0f and %.0f bytes/s on the line\n"
+         "%lu page programs, %lu erases, %lu bytes programmed, %.0f bytes/s\n"
+         "%lu round trips, %.3f s waiting on the host\n"
+         "%lu bytes lost to overruns, %lu pages programmed into the bootloader\n",
+         baudrate, SPM_PAGESIZE, eraseUs, writeUs,
+         secs, stats.commands,
+         stats.received, stats.sent, secs > 0 ? stats.received / secs : 0.0,
+         secs > 0 ? stats.sent / secs : 0.0,
+         stats.programs, stats.erases, programmed, secs > 0 ? programmed / secs : 0.0,
+         stats.roundTrips, stats.waitUs / 1e6,
+         stats.overruns, stats.bootWrites);
+  if (lossRate > 0.0) {
+    printf("%lu bytes dropped by --loss\n", stats.lost);
+  }
+  if (stats.baudChanges) {
+    printf("%lu baud rate changes\n", stats.baudChanges);
+  }
+}
+
+/**
+ * @brief Move bytes whose time has come: those that have arrived go into
+ * the receive buffer, and those that have been sent go out to the pty.
+ */
+static void advance(void) {
+  int64_t now = monotonic_us();
+
+  while (lineCount > 0 && line[lineHead].at <= now) {
+    int away = !receiving && line[lineHead].at >= awaySince;
+    if (lossRate > 0.0 && (double)rand_r(&seed) / RAND_MAX < lossRate) {
+      ++stats.lost;
+    } else if (!away || rxAway < rxBuffer) {
+      rx[(rxHead + rxCount) % sizeof(rx)] = line[lineHead].byte;
+      ++rxCount;
+      rxAway += away;
+    } else {
+      ++stats.overruns;
+    }
+    lineHead = (lineHead + 1) % LINE_LEN;
+    --lineCount;
+  }
+
+  uint8_t out[TX_QUEUE_LEN];
+  size_t count = 0;
+  while (txCount > 0 && tx[txHead].due <= now) {
+    out[count++] = tx[txHead].byte;
+    txHead = (txHead + 1) % TX_QUEUE_LEN;
+    --txCount;
+  }
+  if (count > 0 && -1 == write(master, out, count)) {
+    pabort("writing to the pty");
+  }
+}
+
+/**
+ * @brief Read whatever the host has written to the pty, as far as the
+ * line has room for it, and time its arrival.
+ */
+static void read_host(void) {
+  uint8_t bytes[256];
+  size_t room = LINE_LEN - lineCount - rxCount;
+  ssize_t got = read(master, bytes, room < sizeof(bytes) ? room : sizeof(bytes));
+  if (-1 == got) {
+    if (EINTR == errno || EAGAIN == errno) {
+      return;
+    }
+    pabort("reading the pty");
+  }
+
+  int64_t now = monotonic_us();
+  if (0 == stats.start && got > 0) {
+    stats.start = now;
+  }
+  if (awaiting && got > 0) {
+    ++stats.roundTrips;
+    stats.waitUs += now - awaitingSince;
+    awaiting = 0;
+  }
+  if (got > 0) {
+    replied = 0;
+  }
+
+  for (ssize_t i = 0; i < got; ++i) {
+    lineFree = later(lineFree, now) + byte_us();
+    line[(lineHead + lineCount) % LINE_LEN].at = lineFree;
+    line[(lineHead + lineCount) % LINE_LEN].byte = line_byte(bytes[i]);
+    ++lineCount;
+  }
+  stats.received += got;
+}
+
+/**
+ * @brief Wait until "deadline", or until the host writes something
+ * sooner, then bring the model up to date.  Every wait also ends when the
+ * next byte arrives or leaves, so the caller should check again for
+ * whatever it was waiting for.
+ */
+static void wait_until(int64_t deadline) {
+  if (lineCount > 0) {
+    deadline = deadline < line[lineHead].at ? deadline : line[lineHead].at;
+  }
+  if (txCount > 0) {
+    deadline = deadline < tx[txHead].due ? deadline : tx[txHead].due;
+  }
+
+  struct timespec timeout;
+  struct timespec* ptimeout = NULL;
+  if (deadline < INT64_MAX) {
+    int64_t wait = deadline - monotonic_us();
+    if (wait < 0) {
+      wait = 0;
+    }
+    timeout.tv_sec = wait / 1000000;
+    timeout.tv_nsec = wait % 1000000 * 1000;
+    ptimeout = &timeout;
+  }
+
+  struct pollfd pfd = { master, lineCount + rxCount < LINE_LEN ? POLLIN : 0, 0 };
+  int ready = ppoll(&pfd, 1, ptimeout, NULL);
+  if (-1 == ready && EINTR != errno) {
+    pabort("waiting for the pty");
+  }
+  if (stopping) {
+    print_stats();
+    if (linkPath) {
+      unlink(linkPath);
+    }
+    exit(1);
+  }
+
+  if (ready > 0 && (pfd.revents & POLLIN)) {
+    read_host();
+  }
+  advance();
+}
+
+uint8_t boot_hal_received(void) {
+  receiving = 1;
+  rxAway = 0;
+  advance();
+  if (0 == rxCount) {
+    /*
+     * Nothing left to work on: if we have answered and the host isn't
+     * already sending more, it is waiting on us.
+     */
+    int64_t now = monotonic_us();
+    if (!awaiting && replied && 0 == lineCount) {
+      awaiting = 1;
+      awaitingSince = now;
+    }
+    wait_until(flashDone > now ? flashDone : INT64_MAX);
+  }
+  if (rxCount > 0) {
+    receiving = 0;
+    awaySince = monotonic_us();
+    return 1;
+  }
+  return 0;
+}
+
+uint8_t boot_hal_receive(void) {
+  if (0 == rxCount) {
+    fprintf(stderr, "bootloader read an empty receive buffer\n");
+    abort();
+  }
+  uint8_t data = rx[rxHead];
+  rxHead = (rxHead + 1) % sizeof(rx);
+  --rxCount;
+  return data;
+}
+
+void boot_hal_transmit(uint8_t data) {
+  /* Like uart0_transmit(), wait for room to queue another byte. */
+  advance();
+  while (txCount > txBuffer) {
+    wait_until(INT64_MAX);
+  }
+  if (TX_QUEUE_LEN == txCount) {
+    fprintf(stderr, "transmit queue overflowed\n");
+    abort();
+  }
+
+  txFree = later(txFree, monotonic_us()) + byte_us();
+  tx[(txHead + txCount) % TX_QUEUE_LEN].due = txFree;
+  tx[(txHead + txCount) % TX_QUEUE_LEN].byte = line_byte(data);
+  ++txCount;
+  ++stats.sent;
+  replied = 1;
+  advance();
+}
+
+uint8_t boot_hal_receive_timeout(uint8_t* data, uint16_t timeout_ms) {
+  int64_t deadline = monotonic_us() + timeout_ms * 1000LL;
+  receiving = 1;
+  rxAway = 0;
+  advance();
+  while (0 == rxCount && monotonic_us() < deadline) {
+    wait_until(deadline);
+  }
+  receiving = 0;
+  awaySince = monotonic_us();
+
+  if (0 == rxCount) {
+    return 0;
+  }
+  *data = boot_hal_receive();
+  return 1;
+}
+
+/**
+ * @brief Change the modelled baud rate once everything queued has left,
+ * as uart0_set_ubrr() does.
+ */
+static void set_baudrate(uint32_t rate) {
+  while (txCount > 0) {
+    wait_until(INT64_MAX);
+  }
+  baudrate = rate;
+  ++stats.baudChanges;
+  if (verbose) {
+    printf("line now at %u baud\n", baudrate);
+  }
+}
+
+void boot_hal_set_ubrr(uint16_t ubrr) {
+  set_baudrate(F_CPU / (8UL * (ubrr + 1UL)));
+}
+
+void boot_hal_reset_baud(void) {
+  set_baudrate(configuredBaud);
+}
+
+uint8_t boot_hal_flash_busy(void) {
+  /*
+   * Like boot_spm_busy(), this mustn't block: the bootloader checks it
+   * between bytes.  Just keep taking in whatever the host sends.
+   */
+  int64_t now = monotonic_us();
+  wait_until(now);
+  return flashDone > now;
+}
+
+/**
+ * @brief Abort if the bootloader starts an SPM operation before the last
+ * one has finished, which the real part would ignore.
+ */
+static void check_idle(const char* op, uint16_t address) {
+  if (flashDone > monotonic_us()) {
+    fprintf(stderr, "page %s at %04x while the flash is busy\n", op, address);
+    abort();
+  }
+}
+
+void boot_hal_page_fill(uint16_t address, uint16_t word) {
+  check_idle("fill", address);
+  unsigned offset = address & (SPM_PAGESIZE - 1) & ~1u;
+  pageBuffer[offset] = word & 0xFF;
+  pageBuffer[offset + 1] = word >> 8;
+}
+
+void boot_hal_page_erase(uint16_t address) {
+  check_idle("erase", address);
+  uint16_t page = address & ~(SPM_PAGESIZE - 1);
+  if (page < appSize) {
+    memset(&flash[page], 0xFF, SPM_PAGESIZE);
+  }
+  flashDone = monotonic_us() + eraseUs;
+  rwwBusy = 1;
+  ++stats.erases;
+}
+
+void boot_hal_page_write(uint16_t address) {
+  check_idle("write", address);
+  uint16_t page = address & ~(SPM_PAGESIZE - 1);
+  if (page < appSize) {
+    /* Programming can only clear bits, so an unerased page reads back as the AND. */
+    for (unsigned i = 0; i < SPM_PAGESIZE; ++i) {
+      flash[page + i] &= pageBuffer[i];
+    }
+  } else {
+    ++stats.bootWrites;
+  }
+  memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+  flashDone = monotonic_us() + writeUs;
+  rwwBusy = 1;
+  ++stats.programs;
+
+  if (verbose) {
+    printf("page %04x programmed\n", page);
+  }
+}
+
+void boot_hal_rww_enable(void) {
+  check_idle("rww enable", 0);
+  memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+  rwwBusy = 0;
+}
+
+uint8_t boot_hal_read_flash(uint16_t address) {
+  if (rwwBusy) {
+    fprintf(stderr, "read at %04x before re-enabling the RWW section\n", address);
+    abort();
+  }
+  return address < appSize ? flash[address] : 0xFF;
+}
+
+uint16_t boot_hal_app_size(void) {
+  return appSize;
+}
+
+uint16_t boot_hal_crc16_update(uint16_t crc, uint8_t data) {
+  return crc16_update(crc, data);
+}
+
+void boot_hal_wdt_reset(void) {
+}
+
+int main(int argc, char* argv[]) {
+  parse_opts(argc, argv);
+  configuredBaud = baudrate;
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (-1 == master || -1 == grantpt(master) || -1 == unlockpt(master)) {
+    pabort("opening pty");
+  }
+  const char* slavePath = ptsname(master);
+  if (NULL == slavePath) {
+    pabort("naming pty");
+  }
+
+  /*
+   * Hold the slave open ourselves, so the master doesn't hang up between
+   * clients, and make it raw until a client configures it.
+   */
+  slave = open(slavePath, O_RDWR | O_NOCTTY);
+  if (-1 == slave) {
+    pabort("opening %s", slavePath);
+  }
+  struct termios tio;
+  if (-1 == tcgetattr(slave, &tio)) {
+    pabort("reading %s settings", slavePath);
+  }
+  cfmakeraw(&tio);
+  if (-1 == tcsetattr(slave, TCSANOW, &tio)) {
+    pabort("setting %s raw", slavePath);
+  }
+
+  if (linkPath) {
+    unlink(linkPath);
+    if (-1 == symlink(slavePath, linkPath)) {
+      pabort("linking %s", linkPath);
+    }
+  }
+
+  printf("bootloader on %s%s%s, %u baud, %u byte pages\n", slavePath,
+         linkPath ? " via " : "", linkPath ? linkPath : "", baudrate, SPM_PAGESIZE);
+  fflush(stdout);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  memset(flash, 0xFF, sizeof(flash));
+  if (inputPath) {
+    int fd = open(inputPath, O_RDONLY);
+    if (-1 == fd || -1 == read(fd, flash, appSize) || -1 == close(fd)) {
+      pabort("reading %s", inputPath);
+    }
+  }
+  memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+
+  do {
+    ++stats.commands;
+  } while (boot_command());
+
+  /* Let the answer to 'E' finish leaving before reporting. */
+  while (txCount > 0) {
+    wait_until(INT64_MAX);
+  }
+  print_stats();
+
+  if (outputPath) {
+    int fd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == fd || -1 == write(fd, flash, appSize) || -1 == close(fd)) {
+      pabort("writing %s", outputPath);
+    }
+  }
+
+  /* Give the host a moment to read the answer before the pty goes away. */
+  tcdrain(slave);
+  usleep(100000);
+
+  if (linkPath) {
+    unlink(linkPath);
+  }
+  return 0;
+}
@@ -17,10 +17,12 @@
 #include <limits.h>
 #include <errno.h>
 #include <getopt.h>
-#include <assert.h>
+#include <termios.h>
 
 #include <arpa/inet.h>
 
+#include "crc16.h"
+#include "ihex.h"
 #include "io.h"
 #include "serial.h"
 #include "math.h"
@@ -28,24 +30,79 @@
 #define SSIZET_FMT "%zd"
 
 /* Options that may be set from the command-line. */
-static char ttyDevicePath[PATH_MAX] = DEFAULT_TTY_DEVICE;
 static char ihexFilePath[PATH_MAX];
 static SerialOptions serialOptions;
 static int verbose;
+static int blockMode;
+static int diffMode;
+static int verifyMode;
+static int compressMode;
+static const char* dumpPath = NULL;
+static uint32_t switchBaud;   // 0 stays at --baud
+static size_t window;   // 0 picks the largest window the bootloader allows
+static int timeoutMs = 2000;
+
+/* Status bytes the bootloader returns for a page sent with 'P'. */
+#define BOOT_ACK 'K'
+#define BOOT_NACK 'N'
+
+/*
+ * Byte sent to finish a frame the bootloader may still be reading.  No
+ * command uses it, so whatever is left over is answered with '?'.
+ */
+#define BOOT_FILLER 0xFF
 
-typedef struct {
-  uint8_t  length;
-  uint16_t address;
-  uint8_t  type;
-  uint8_t  data[0xFF];
-  uint8_t  crc;
-} IntelHexRecord;
+/* Byte sent at a new baud rate for the bootloader to answer. */
+#define BOOT_PROBE 0x55
+
+/* How long the bootloader waits for BOOT_PROBE before going back. */
+#define BOOT_PROBE_MS 100
+
+/* Rates the bootloader's 'S' command can switch to, by number. */
+static const uint32_t bootBaudRates[] = {
+  9600, 19200, 38400, 57600, 115200, 230400, 250000, 500000, 1000000, 2000000,
+};
+
+/* Times a page may be rejected in a row before the upload gives up. */
+#define MAX_PAGE_TRIES 8
+
+/* Largest image addressable by the bootloader's 16-bit addresses. */
+#define IMAGE_SIZE 0x10000
+
+/* Largest SPM page size of any AVR, and so of any bootloader page. */
+#define MAX_PAGESIZE 256
+
+/* Most bytes sent in one 'L', 'A', 'D' exchange, as in a typical record. */
+#define ECHO_RUN 16
+
+/* Long options without a short equivalent. */
+#define OPT_VMIN  0x100
+#define OPT_VTIME 0x101
 
 void print_usage(const char *prog) {
-  printf("Usage: %s [-tfb]\n", prog);
+  printf("Usage: %s [-tfbSlBdzVDwTv]\n", prog);
   puts("  -t --tty      device to use (default /dev/ttyAMA0)\n"
        "  -f --file     file containing ihex binary\n"
-       "  -b --baud     baud rate (default 9600)\n"
+       "  -b --baud     baud rate (default 9600); any rate the driver\n"
+       "                supports, e.g. 250000, 500000 or 1000000\n"
+       "  -S --switch-baud  once connected, move to the fastest rate up to\n"
+       "                this that the bootloader reaches exactly, going back\n"
+       "                to --baud if it doesn't answer there\n"
+       "  -l --low-latency  ask the serial driver not to batch input\n"
+       "     --vmin     bytes a read waits for (default 1)\n"
+       "     --vtime    read timeout between bytes, in 0.1s (default 0)\n"
+       "  -B --block    send whole pages with a CRC instead of echoed bytes\n"
+       "  -d --diff     only send the pages whose flash contents differ\n"
+       "                from the file (implies --block)\n"
+       "  -z --compress send blank pages as erase-only frames and others\n"
+       "                run-length encoded when shorter (implies --block)\n"
+       "  -V --verify   read the flash back after the upload and check it\n"
+       "                against the file\n"
+       "  -D --dump     save the bootloader's whole application section to\n"
+       "                this file; --file may then be left out\n"
+       "  -w --window   pages in flight in block mode, at most one more than\n"
+       "                the bootloader's page buffers (default: that many)\n"
+       "  -T --timeout  ms to wait for a bootloader response (default 2000)\n"
        "  -v --verbose  Enable verbose output\n");
   exit(1);
 }
@@ -55,24 +112,35 @@ void parse_opts(int argc, char *argv[]) {
     { "tty",      1, 0, 't' },
     { "file",     1, 0, 'f' },
     { "baud",     1, 0, 'b' },
+    { "switch-baud", 1, 0, 'S' },
+    { "low-latency", 0, 0, 'l' },
+    { "vmin",     1, 0, OPT_VMIN },
+    { "vtime",    1, 0, OPT_VTIME },
+    { "block",    0, 0, 'B' },
+    { "diff",     0, 0, 'd' },
+    { "compress", 0, 0, 'z' },
+    { "verify",   0, 0, 'V' },
+    { "dump",     1, 0, 'D' },
+    { "window",   1, 0, 'w' },
+    { "timeout",  1, 0, 'T' },
     { "verbose",  0, 0, 'v' },
     { NULL,       0, 0, 0 },
   };
 
   while (1) {
-    int c = getopt_long(argc, argv, "t:f:b:v", lopts, NULL);
+    int c = getopt_long(argc, argv, "t:f:b:S:BdzVD:w:T:vl", lopts, NULL);
     if (-1 == c) {
       break;
     }
     
     switch (c) {
     case 't': {
-      size_t len = MIN(strlen(optarg), PATH_MAX);
-      if (!strncpy(ttyDevicePath, optarg, len)) {
+      size_t len = MIN(strlen(optarg), PATH_MAX - 1);
+      if (!strncpy(serialOptions.device, optarg, len)) {
         perror("Copying tty path.");
         abort();
       }
-      ttyDevicePath[len] = '\0';
+      serialOptions.device[len] = '\0';
       break;
     }
     case 'f': {
@@ -94,6 +162,70 @@ void parse_opts(int argc, char *argv[]) {
       serialOptions.baudrate = val;
       break;
     }
+    case 'S': {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 1 || val > UINT32_MAX) {
+        fprintf(stderr, "Invalid --switch-baud given.\n");
+        exit(1);
+      }
+
+      switchBaud = val;
+      break;
+    }
+    case 'l':
+      serialOptions.low_latency = 1;
+      break;
+    case OPT_VMIN:
+    case OPT_VTIME: {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 0 || val > UINT8_MAX) {
+        fprintf(stderr, "Invalid --%s given; must be 0-255.\n",
+                OPT_VMIN == c ? "vmin" : "vtime");
+        exit(1);
+      }
+
+      if (OPT_VMIN == c) {
+        serialOptions.vmin = val;
+      } else {
+        serialOptions.vtime = val;
+      }
+      break;
+    }
+    case 'B':
+      blockMode = 1;
+      break;
+    case 'd':
+      diffMode = blockMode = 1;
+      break;
+    case 'z':
+      compressMode = blockMode = 1;
+      break;
+    case 'V':
+      verifyMode = 1;
+      break;
+    case 'D':
+      dumpPath = optarg;
+      break;
+    case 'w': {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 1 || val > 128) {
+        fprintf(stderr, "Invalid window given; must be 1-128.\n");
+        exit(1);
+      }
+
+      window = val;
+      break;
+    }
+    case 'T': {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 1 || val > INT_MAX) {
+        fprintf(stderr, "Invalid timeout given.\n");
+        exit(1);
+      }
+
+      timeoutMs = val;
+      break;
+    }
     case 'v':
       verbose = 1;
       break;
@@ -103,199 +235,781 @@ void parse_opts(int argc, char *argv[]) {
     }
   }
 
-  if (strlen(ihexFilePath) == 0) {
+  if (strlen(ihexFilePath) == 0 && (verifyMode || NULL == dumpPath)) {
     print_usage(argv[0]);
     exit(1);
   }
 }
 
 /**
- * @brief Convert a character to its hex equivalent.
- * @param hexch A character representing a hex digit.
- * @return The integer value of a hex character.
+ * @brief Send data to the bootloader in a single write, giving up on the
+ * upload if that fails.
+ * @param serialfd
+ * @param data
+ * @param length
+ */
+static void send_bytes(int serialfd, const void* data, size_t length) {
+  if (-1 == writetty(serialfd, data, length)) {
+    pabort("writing to %s", serialOptions.device);
+  }
+}
+
+/**
+ * @brief Read "n" bytes of a bootloader response, giving up on the upload
+ * if they don't all arrive in time.
+ * @param serialfd
+ * @param buf
+ * @param n
  */
-static uint8_t charNibbleToUInt(char hexch) {
-  hexch -= '0';
-  if (hexch > 9) {
-    hexch -= 7;         // 7 chars between '9' and 'A' on ascii table
+static void receive_bytes(int serialfd, void* buf, size_t n) {
+  ssize_t got = readtty_n(serialfd, buf, n, timeoutMs);
+  if (-1 == got) {
+    pabort("reading from %s", serialOptions.device);
   }
+  if ((size_t)got < n) {
+    fprintf(stderr, "no response from the bootloader: got " SSIZET_FMT " of "
+            SSIZET_FMT " bytes in %d ms (%s)\n", got, n, timeoutMs, strerror(errno));
+    exit(1);
+  }
+}
 
-  assert(hexch >= 0 && hexch <= 15);
-  return hexch;
+static uint8_t receive_byte(int serialfd) {
+  uint8_t data;
+  receive_bytes(serialfd, &data, 1);
+  return data;
 }
 
 /**
- * @brief Converts a character byte pair to its unsigned int equivalent.
- * @param hex Two hex characters.
- * @return The unsigned value of the input hex character pair.
+ * @brief Like receive_byte, but leave a timeout to the caller.
+ * @return 1 if a byte arrived, or 0 if none did in time.
  */
-static uint8_t charByteToUInt(char hex[2]) {
-  return charNibbleToUInt(hex[0]) << 4 | charNibbleToUInt(hex[1]);
+static int try_receive_byte(int serialfd, uint8_t* data) {
+  ssize_t got = readtty_n(serialfd, data, 1, timeoutMs);
+  if (-1 == got) {
+    pabort("reading from %s", serialOptions.device);
+  }
+  return got;
 }
 
-int fetch_record(int fd, IntelHexRecord* ihex) {
-  uint8_t crc;
-  if (-1 == read(fd, &crc, 1)) {
-    pabort("read start of ihex record");
+/**
+ * @brief Upload a run of bytes using the per-byte echo protocol ('L', 'A',
+ * 'D'), which the bootloader checks with the same checksum as an ihex
+ * data record.
+ * @param serialfd
+ * @param address Where the run starts.
+ * @param data
+ * @param length At most 255 bytes.
+ */
+static void upload_record(int serialfd, uint16_t address, const uint8_t* data,
+                          uint8_t length) {
+  uint8_t expected = length + (address >> 8) + (address & 0xFF);
+  for (size_t i = 0; i < length; ++i) {
+    expected += data[i];
   }
-  assert(':' == crc);
+  expected = ~expected + 1;
+
+  /* Send the length of our data. */
+  uint8_t lengthCommand[] = { 'L', length };
+  send_bytes(serialfd, lengthCommand, sizeof(lengthCommand));
+  uint8_t len = receive_byte(serialfd);
+  if (len != length) {
+    fprintf(stderr, "bad length response at %04x: expected %02x, got %02x\n",
+            address, length, len);
+    exit(1);
+  }
+  printf("%02x", len);
+
+  /* Send the address for our data. */
+  uint8_t addressCommand[] = { 'A', address >> 8, address & 0xFF };
+  send_bytes(serialfd, addressCommand, sizeof(addressCommand));
 
-  crc = 0;
-  
-  char byte[2];
-  if (-1 == read(fd, byte, 2)) {
-    pabort("read ihex length");
+  uint8_t addrsum = receive_byte(serialfd);
+  if (addrsum != (uint8_t)((address >> 8) + (address & 0xFF))) {
+    fprintf(stderr, "bad address sum at %04x: expected %02x, got %02x\n", address,
+            (uint8_t)((address >> 8) + (address & 0xFF)), addrsum);
+    exit(1);
+  }
+  printf("%04x", address);
+
+  printf("00");
+
+  /* Send our binary data. */
+  send_bytes(serialfd, "D", 1);
+  for (size_t i = 0; i < length; ++i) {
+    send_bytes(serialfd, &data[i], sizeof(uint8_t));
+    uint8_t echo = receive_byte(serialfd);
+    if (echo != data[i]) {
+      fprintf(stderr, "bad data byte at %04zx, expected %02x, got %02x\n",
+              address + i, data[i], echo);
+      exit(1);
+    } else {
+      printf("%02x", echo);
+    }
   }
-  ihex->length = charByteToUInt(byte);
-  crc += ihex->length;
 
-  if (-1 == read(fd, byte, 2)) {
-    pabort("read ihex address msb");
+  /* Read the computer CRC and compare it to ours. */
+  uint8_t crc = receive_byte(serialfd);
+  if (crc != expected) {
+    fprintf(stderr, "bad crc response at %04x, expected %02x, got %02x\n",
+            address, expected, crc);
+    exit(1);
+  } else {
+    printf("%02x", crc);
   }
-  ihex->address = charByteToUInt(byte) << 8;
-  crc += ihex->address >> 8;
+  printf("\n");
+}
 
-  if (-1 == read(fd, byte, 2)) {
-    pabort("read ihex address lsb");
+/**
+ * @brief Upload every byte the .hex file wrote, with the echo protocol,
+ * in runs of at most ECHO_RUN bytes.
+ * @param serialfd
+ * @param image
+ */
+static void upload_records(int serialfd, const IntelHexImage* image) {
+  uint32_t offset = 0;
+  while (offset < image->size) {
+    if (!image->used[offset]) {
+      ++offset;
+      continue;
+    }
+
+    uint32_t length = 1;
+    while (length < ECHO_RUN && offset + length < image->size &&
+           image->used[offset + length]) {
+      ++length;
+    }
+    upload_record(serialfd, image->base + offset, &image->data[offset], length);
+    offset += length;
   }
-  ihex->address |= charByteToUInt(byte);
-  crc += ihex->address & 0xFF;
+}
 
-  if (-1 == read(fd, byte, 2)) {
-    pabort("read ihex type");
+/**
+ * What the bootloader reports about itself through the 'I' command.
+ */
+typedef struct {
+  uint8_t  version;       // protocol version
+  uint16_t pagesize;      // SPM page size, in bytes
+  uint8_t  buffers;       // RAM page buffers; limits the 'P' window
+  uint16_t appSize;       // flash below the bootloader; 0 before protocol 5
+  uint32_t fcpu;          // clock, in Hz; 0 before protocol 7
+  uint16_t rates;         // bit n: bootBaudRates[n] is offered by 'S'
+} BootInfo;
+
+/**
+ * @brief Send the 'I' command and read its answer, leaving a timeout to
+ * the caller.  This also restarts the bootloader's 'P' sequence numbers
+ * at 0.
+ * @param serialfd
+ * @param info Receives the answer, after its length byte.
+ * @return The length of the answer, or -1 if it didn't all arrive in time.
+ */
+static int request_info(int serialfd, uint8_t info[UINT8_MAX]) {
+  send_bytes(serialfd, "I", 1);
+
+  uint8_t length;
+  if (!try_receive_byte(serialfd, &length)) {
+    return -1;
   }
-  ihex->type = charByteToUInt(byte);
-  crc += ihex->type;
-    
-  for (size_t i = 0; i < ihex->length; ++i) {
-    if (-1 == read(fd, byte, 2)) {
-      pabort("read ihex data");
-    }
+  ssize_t got = readtty_n(serialfd, info, length, timeoutMs);
+  if (-1 == got) {
+    pabort("reading from %s", serialOptions.device);
+  }
+  return (size_t)got == length ? length : -1;
+}
 
-    ihex->data[i] = charByteToUInt(byte);
-    crc += ihex->data[i];
+/**
+ * @brief Make sense of an answer read by request_info.
+ * @param info
+ * @param length
+ * @return The bootloader's information.
+ */
+static BootInfo parse_info(const uint8_t* info, uint8_t length) {
+  if (length < 4 || info[0] < 3) {
+    fprintf(stderr, "bootloader info too short (%u bytes); does it support block mode?\n",
+            length);
+    exit(1);
   }
 
-  if (-1 == read(fd, byte, 2)) {
-    pabort("read ihex crc");
+  BootInfo boot = { info[0], info[1] << 8 | info[2], info[3],
+                    length >= 6 ? info[4] << 8 | info[5] : 0, 0, 0 };
+  if (length >= 12) {
+    boot.fcpu = (uint32_t)info[6] << 24 | info[7] << 16 | info[8] << 8 | info[9];
+    boot.rates = info[10] << 8 | info[11];
   }
-  crc = ~crc + 1;
-  if (crc != charByteToUInt(byte)) {
-    fprintf(stderr, "expected crc %02x, got %02x", charByteToUInt(byte), crc);
-    abort();
+  if (verbose) {
+    printf("bootloader protocol %u, page size %u, %u page buffers, %u byte application\n",
+           boot.version, boot.pagesize, boot.buffers, boot.appSize);
+    if (boot.fcpu) {
+      printf("bootloader clock %u Hz, offering", boot.fcpu);
+      for (size_t i = 0; i < sizeof(bootBaudRates) / sizeof(*bootBaudRates); ++i) {
+        if (boot.rates & 1u << i) {
+          printf(" %u", bootBaudRates[i]);
+        }
+      }
+      printf(" baud\n");
+    }
   }
-  ihex->crc = crc;
+  if (0 == boot.pagesize || (boot.pagesize & (boot.pagesize - 1)) ||
+      boot.pagesize > MAX_PAGESIZE) {
+    fprintf(stderr, "bootloader reported a bad page size: %u\n", boot.pagesize);
+    exit(1);
+  }
+
+  return boot;
+}
 
-  if (-1 == read(fd, byte, 2)) {
-    pabort("chomp CR NL");
+/**
+ * @brief Ask the bootloader about itself with the 'I' command, giving up on
+ * the upload if it doesn't answer.
+ * @param serialfd
+ * @return The bootloader's information.
+ */
+static BootInfo query_info(int serialfd) {
+  uint8_t info[UINT8_MAX];
+  int length = request_info(serialfd, info);
+  if (-1 == length) {
+    fprintf(stderr, "no answer from the bootloader to 'I' in %d ms\n", timeoutMs);
+    exit(1);
   }
-  assert('\r' == byte[0]);
-  assert('\n' == byte[1]);
+  return parse_info(info, length);
+}
+
+/* Frames of each kind sent by send_page(), and their total size. */
+static size_t blankFrames;
+static size_t rleFrames;
+static size_t frameBytes;
+
+/**
+ * @brief Run-length encode data the way the bootloader's 'Z' command
+ * decodes it.  Each run starts with a control byte c: below 0x80, c + 1
+ * literal bytes follow; otherwise one byte follows, to be repeated
+ * c - 0x80 + 3 times.
+ * @param data
+ * @param length
+ * @param out Receives the code.
+ * @param max Most bytes of code wanted.
+ * @return Bytes of code, or 0 if it would take more than "max".
+ */
+static size_t rle_encode(const uint8_t* data, size_t length, uint8_t* out, size_t max) {
+  size_t n = 0;
+  size_t i = 0;
+  while (i < length) {
+    size_t run = 1;
+    while (i + run < length && run < 0x7F + 3 && data[i + run] == data[i]) {
+      ++run;
+    }
+
+    if (run >= 3) {
+      if (n + 2 > max) {
+        return 0;
+      }
+      out[n++] = 0x80 + run - 3;
+      out[n++] = data[i];
+      i += run;
+      continue;
+    }
 
-  return 0;     // read one line of ihex
+    /* Gather literal bytes up to the next run worth encoding. */
+    size_t count = 0;
+    while (i + count < length && count < 0x80 &&
+           !(i + count + 2 < length && data[i + count] == data[i + count + 1] &&
+             data[i + count] == data[i + count + 2])) {
+      ++count;
+    }
+    if (n + 1 + count > max) {
+      return 0;
+    }
+    out[n++] = count - 1;
+    memcpy(&out[n], &data[i], count);
+    n += count;
+    i += count;
+  }
+  return n;
 }
 
-static void IntelHexRecord_print(FILE* s, const IntelHexRecord* record) {
-  assert(s);
-  fprintf(s,
-          "record = {\n"
-          "  length=%02x\n"
-          "  address=%04x\n"
-          "  type=%02x\n"
-          "  data=",
-          record->length, record->address, record->type);
-
-  for (size_t i = 0; i < record->length; ++i) {
-    fprintf(s, "%02x", record->data[i]);
-  }
-  fprintf(s,
-          "\n  crc=%02x\n"
-          "}\n",
-          record->crc);
+/**
+ * @brief Set the line back to --baud after a failed switch, wait for the
+ * bootloader to give up on its probe and do the same, and check with 'I'
+ * that the two ends are in step again.
+ * @param serialfd
+ * @return The bootloader's information, read again.
+ */
+static BootInfo restore_baud(int serialfd) {
+  if (-1 == serial_set_baudrate(serialfd, serialOptions.baudrate)) {
+    pabort("restoring %u baud", serialOptions.baudrate);
+  }
+  usleep(2 * BOOT_PROBE_MS * 1000);
+  tcflush(serialfd, TCIFLUSH);
+  return query_info(serialfd);
 }
 
-int main(int argc, char* argv[]) {
-  SerialOptions_init(&serialOptions);
-  parse_opts(argc, argv);
+/**
+ * @brief Move the line to the fastest rate, up to --switch-baud, that the
+ * bootloader offers with 'S' and answers a probe at.  A rate that fails
+ * puts both ends back at --baud before the next slower one is tried.
+ * @param serialfd
+ * @param boot Updated if the bootloader had to be asked again.
+ */
+static void switch_baud(int serialfd, BootInfo* boot) {
+  size_t i = sizeof(bootBaudRates) / sizeof(*bootBaudRates);
+  while (i-- > 0) {
+    uint32_t rate = bootBaudRates[i];
+    if (!(boot->rates & 1u << i) || rate > switchBaud || rate <= serialOptions.baudrate) {
+      continue;
+    }
 
-  int serialfd = SerialOptions_open(&serialOptions);
+    uint8_t request[] = { 'S', i, (uint8_t)~i };
+    send_bytes(serialfd, request, sizeof(request));
+    if (BOOT_ACK != receive_byte(serialfd)) {
+      fprintf(stderr, "bootloader refused %u baud\n", rate);
+      continue;
+    }
+
+    if (-1 == serial_set_baudrate(serialfd, rate)) {
+      fprintf(stderr, "can't set %u baud on %s: %s\n", rate, serialOptions.device,
+              strerror(errno));
+      *boot = restore_baud(serialfd);
+      continue;
+    }
+
+    uint8_t probe = BOOT_PROBE;
+    uint8_t answer = 0;
+    send_bytes(serialfd, &probe, 1);
+    if (1 == readtty_n(serialfd, &answer, 1, 2 * BOOT_PROBE_MS) && BOOT_ACK == answer) {
+      printf("switched to %u baud\n", rate);
+      return;
+    }
+
+    /*
+     * The bootloader may have taken the probe and only its answer got lost,
+     * so ask again at the new rate.  One that went back to --baud reads
+     * garbage instead, and whatever it answers fails the checks below.
+     */
+    uint8_t info[UINT8_MAX];
+    tcflush(serialfd, TCIFLUSH);
+    int length = request_info(serialfd, info);
+    if (length >= 12 && info[0] == boot->version) {
+      *boot = parse_info(info, length);
+      printf("switched to %u baud\n", rate);
+      return;
+    }
 
-  int fd = open(ihexFilePath, O_RDONLY);
-  if (-1 == fd) {
-    pabort("open %s", ihexFilePath);
+    fprintf(stderr, "no answer at %u baud; back to %u\n", rate, serialOptions.baudrate);
+    *boot = restore_baud(serialfd);
   }
+}
 
-  IntelHexRecord record;
-  for (fetch_record(fd, &record); 1 != record.type; fetch_record(fd, &record)) {
-    static size_t lineno = 0;
-    ++lineno;
-    
-    if (verbose) {
-      IntelHexRecord_print(stdout, &record);
+/**
+ * @brief Send one page frame: sequence number, address, page and CRC-16
+ * go out in a single write.  With --compress, a page of 0xFF goes as a
+ * 'B' frame, which needs no data, and a page that run-length encodes to
+ * fewer bytes goes as a 'Z' frame; otherwise the page is sent whole with
+ * 'P'.
+ * @param serialfd
+ * @param image Program image, aligned to the bootloader's pages.
+ * @param address Page-aligned address of the page to send.
+ * @param pagesize
+ * @param seq Sequence number of this frame.
+ */
+static void send_page(int serialfd, const IntelHexImage* image, uint16_t address,
+                      uint16_t pagesize, uint8_t seq) {
+  uint8_t frame[2 + sizeof(uint16_t) + MAX_PAGESIZE + sizeof(uint16_t)];
+  const uint8_t* page = &image->data[address - image->base];
+  size_t length = 0;
+
+  frame[length++] = 'P';
+  frame[length++] = seq;
+  frame[length++] = address >> 8;
+  frame[length++] = address & 0xFF;
+
+  int blank = 0;
+  size_t code = 0;
+  if (compressMode) {
+    size_t erased = 0;
+    while (erased < pagesize && 0xFF == page[erased]) {
+      ++erased;
     }
+    blank = erased == pagesize;
+    if (!blank) {
+      code = rle_encode(page, pagesize, &frame[length + 1], MIN(pagesize - 2, UINT8_MAX));
+    }
+  }
 
-    /* Send the length of our data. */
-    writetty(serialfd, &"L", 1);
-    writetty(serialfd, &record.length, sizeof(uint8_t));
-    uint8_t len = readtty(serialfd);
-    if (len != record.length) {
-      fprintf(stderr, "bad length response line " SSIZET_FMT ": expected %02x, got %02x\n",
-              lineno, record.length, len);
-      exit(1);
+  if (blank) {
+    frame[0] = 'B';
+    ++blankFrames;
+  } else if (code) {
+    frame[0] = 'Z';
+    frame[length++] = code;
+    length += code;
+    ++rleFrames;
+  } else {
+    memcpy(&frame[length], page, pagesize);
+    length += pagesize;
+  }
+
+  uint16_t crc = crc16(0, &frame[1], length - 1);
+  frame[length++] = crc >> 8;
+  frame[length++] = crc & 0xFF;
+
+  send_bytes(serialfd, frame, length);
+  frameBytes += length;
+}
+
+/**
+ * @brief Upload pages with up to "window" 'P' frames in flight.
+ *
+ * Frames are acknowledged in order, with BOOT_ACK and their sequence
+ * number, once their pages are programmed.  After a damaged frame or a
+ * lost byte, the bootloader acknowledges whatever it had already
+ * accepted, discards the rest until we stop sending, and answers BOOT_NACK
+ * and the sequence number it expects, or '?' if the loss left it reading
+ * commands.  Either way, nothing after the last acknowledged page was
+ * kept, so we resend from there.
+ *
+ * If the byte lost was in the last frame we sent, or in an answer, nothing
+ * more comes back.  Once the ack is overdue, BOOT_FILLER bytes finish
+ * whatever frame the bootloader is still reading, and going quiet lets it
+ * answer as above.  Acks lost on the way back show up as a BOOT_NACK
+ * ahead of the oldest page we have in flight.
+ *
+ * @param serialfd
+ * @param image Program image, aligned to the bootloader's pages.
+ * @param pages Page-aligned addresses of the pages to send, in order.
+ * @param npages
+ * @param pagesize
+ * @param window Most frames to have in flight at once.
+ */
+static void upload_pages(int serialfd, const IntelHexImage* image, const uint16_t* pages,
+                         size_t npages, uint16_t pagesize, size_t window) {
+  size_t base = 0;      // oldest page not yet acknowledged
+  size_t next = 0;      // next page to send
+  size_t resent = 0;
+  unsigned tries = 0;   // go-backs since "base" last moved
+  int filled = 0;       // filler sent; send nothing new until the bootloader answers
+
+  while (base < npages) {
+    while (!filled && next < npages && next - base < window) {
+      send_page(serialfd, image, pages[next], pagesize, next & 0xFF);
+      ++next;
     }
-    printf("%02x", len);
 
-    /* Send the address for our data. */
-    writetty(serialfd, &"A", 1);
-    record.address = htons(record.address);
-    writetty(serialfd, &record.address, sizeof(uint16_t));
-    record.address = ntohs(record.address);
+    uint8_t status;
+    uint8_t seq = 0;
+    int answered = try_receive_byte(serialfd, &status);
+    if (answered && (BOOT_ACK == status || BOOT_NACK == status)) {
+      answered = try_receive_byte(serialfd, &seq);
+    }
 
-    uint8_t addrsum = readtty(serialfd);
-    if (addrsum != (record.address >> 8) + (record.address & 0xFF)) {
-      fprintf(stderr, "bad address sum line " SSIZET_FMT ": expected %02x, got %02x\n", lineno,
-              (record.address >> 8) + (record.address & 0xFF), addrsum);
+    if (answered && BOOT_ACK == status && base < next && seq == (base & 0xFF)) {
+      printf("page %04x ok\n", pages[base]);
+      ++base;
+      tries = 0;
+      continue;
+    }
+
+    if (!answered || (BOOT_NACK != status && '?' != status)) {
+      /* A byte went missing, here or on the way back. */
+      if (filled && ++tries > MAX_PAGE_TRIES) {
+        fprintf(stderr, "no answer for page %04x after %u tries; giving up\n",
+                pages[base], tries);
+        exit(1);
+      }
+      if (verbose) {
+        printf("page %04x not acknowledged; resyncing\n", pages[base]);
+      }
+      uint8_t filler[2 + sizeof(uint16_t) + MAX_PAGESIZE + sizeof(uint16_t)];
+      memset(filler, BOOT_FILLER, sizeof(filler));
+      send_bytes(serialfd, filler, sizeof(filler));
+      filled = 1;
+      continue;
+    }
+    filled = 0;
+
+    if (BOOT_NACK == status) {
+      /* Any pages before the one it expects were programmed. */
+      size_t ahead = (uint8_t)(seq - base);
+      if (ahead > next - base) {
+        fprintf(stderr, "bootloader expects unknown frame %02x\n", seq);
+        exit(1);
+      }
+      for (; ahead; --ahead, ++base) {
+        printf("page %04x ok\n", pages[base]);
+        tries = 0;
+      }
+      if (base == npages) {
+        break;
+      }
+    }
+
+    if (++tries > MAX_PAGE_TRIES) {
+      fprintf(stderr, "page %04x rejected %u times; giving up\n", pages[base], tries);
       exit(1);
     }
-    printf("%04x", record.address);
+    if (verbose) {
+      printf("page %04x rejected; resending\n", pages[base]);
+    }
+    resent += next - base;
+    next = base;
+  }
+
+  printf(SSIZET_FMT " pages sent, window " SSIZET_FMT ", " SSIZET_FMT " resent\n",
+         npages, window, resent);
+  if (compressMode) {
+    printf(SSIZET_FMT " blank, " SSIZET_FMT " run-length encoded; " SSIZET_FMT
+           " bytes of frames for " SSIZET_FMT " bytes of pages\n", blankFrames, rleFrames,
+           frameBytes, (npages + resent) * pagesize);
+  }
+}
+
+/**
+ * @brief Drop the pages whose flash contents already match the image.
+ * The bootloader reports the CRC-16 of each run of consecutive pages
+ * with the 'C' command, and only pages whose CRC differs are kept.
+ * @param serialfd
+ * @param image Program image, aligned to the bootloader's pages.
+ * @param pages Page-aligned addresses, in order; updated in place.
+ * @param npages
+ * @param pagesize
+ * @return The number of pages left in "pages".
+ */
+static size_t changed_pages(int serialfd, const IntelHexImage* image, uint16_t* pages,
+                            size_t npages, uint16_t pagesize) {
+  size_t changed = 0;
+  size_t i = 0;
+  while (i < npages) {
+    size_t count = 1;
+    while (i + count < npages && count < UINT8_MAX &&
+           pages[i + count] == pages[i] + count * pagesize) {
+      ++count;
+    }
+
+    uint8_t request[] = { 'C', pages[i] >> 8, pages[i] & 0xFF, count };
+    send_bytes(serialfd, request, sizeof(request));
+    uint8_t crcs[2 * UINT8_MAX];
+    receive_bytes(serialfd, crcs, 2 * count);
+
+    for (size_t j = 0; j < count; ++j, ++i) {
+      uint16_t flashCrc = crcs[2 * j] << 8 | crcs[2 * j + 1];
+      uint16_t imageCrc = crc16(0, &image->data[pages[i] - image->base], pagesize);
+      if (flashCrc != imageCrc) {
+        pages[changed++] = pages[i];
+      } else if (verbose) {
+        printf("page %04x unchanged\n", pages[i]);
+      }
+    }
+  }
 
-    printf("%02x", record.type);
+  printf(SSIZET_FMT " of " SSIZET_FMT " pages changed\n", changed, npages);
+  return changed;
+}
 
-    /* Send our binary data. */
-    writetty(serialfd, &"D", 1);
-    for (size_t i = 0; i < record.length; ++i) {
-      writetty(serialfd, &record.data[i], sizeof(uint8_t));
-      uint8_t data = readtty(serialfd);
-      if (data != record.data[i]) {
-        fprintf(stderr, "bad data byte column " SSIZET_FMT " line "
-                SSIZET_FMT ", expected %02x, got %02x\n", i, lineno, record.data[i], data);
+/**
+ * @brief Read flash pages with the 'R' command.  Each page arrives with
+ * the running CRC of everything read so far, and reading starts again
+ * from the first page whose CRC doesn't match.
+ * @param serialfd
+ * @param address Page-aligned address of the first page.
+ * @param buf Receives npages * pagesize bytes.
+ * @param npages
+ * @param pagesize
+ */
+static void read_flash(int serialfd, uint16_t address, uint8_t* buf, size_t npages,
+                       uint16_t pagesize) {
+  size_t page = 0;
+  unsigned tries = 0;   // damaged reads since a page last arrived intact
+
+  while (page < npages) {
+    size_t count = MIN(npages - page, UINT8_MAX);
+    uint16_t start = address + page * pagesize;
+    uint8_t request[] = { 'R', start >> 8, start & 0xFF, count };
+    send_bytes(serialfd, request, sizeof(request));
+
+    /* Take the whole answer, even past a damaged page, before asking again. */
+    uint16_t crc = 0;
+    size_t good = count;
+    for (size_t i = 0; i < count; ++i) {
+      uint8_t* data = &buf[(page + i) * pagesize];
+      uint8_t check[2];
+      receive_bytes(serialfd, data, pagesize);
+      receive_bytes(serialfd, check, sizeof(check));
+      crc = crc16(crc, data, pagesize);
+      if (good == count && crc != (check[0] << 8 | check[1])) {
+        good = i;
+      }
+    }
+
+    page += good;
+    if (good < count) {
+      tries = good ? 1 : tries + 1;
+      if (tries > MAX_PAGE_TRIES) {
+        fprintf(stderr, "page %04zx read back damaged %u times; giving up\n",
+                address + page * pagesize, tries);
+        exit(1);
+      }
+      if (verbose) {
+        printf("page %04zx read back damaged; reading again\n", address + page * pagesize);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Read back the flash pages the .hex file wrote to, and compare
+ * each byte it wrote.
+ * @param serialfd
+ * @param image
+ * @param pagesize The bootloader's page size.
+ * @return The number of bytes that differ.
+ */
+static size_t verify_image(int serialfd, const IntelHexImage* image, uint16_t pagesize) {
+  static uint8_t flash[IMAGE_SIZE];
+  uint32_t start = image->base & ~(uint32_t)(pagesize - 1);
+  uint32_t end = (image->base + image->size + pagesize - 1) & ~(uint32_t)(pagesize - 1);
+  read_flash(serialfd, start, &flash[start], (end - start) / pagesize, pagesize);
+
+  size_t bad = 0;
+  for (uint32_t i = 0; i < image->size; ++i) {
+    uint32_t addr = image->base + i;
+    if (image->used[i] && flash[addr] != image->data[i]) {
+      if (++bad <= 8) {
+        fprintf(stderr, "%04x: expected %02x, flash has %02x\n", addr, image->data[i],
+                flash[addr]);
+      }
+    }
+  }
+  return bad;
+}
+
+/**
+ * @brief Save the whole application section, as the bootloader reads it
+ * back, to a file.
+ * @param serialfd
+ * @param boot
+ * @param path
+ */
+static void dump_flash(int serialfd, const BootInfo* boot, const char* path) {
+  static uint8_t flash[IMAGE_SIZE];
+  int64_t start = monotonic_us();
+  read_flash(serialfd, 0, flash, boot->appSize / boot->pagesize, boot->pagesize);
+  int64_t elapsed = monotonic_us() - start;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (-1 == fd || -1 == write(fd, flash, boot->appSize) || -1 == close(fd)) {
+    pabort("writing %s", path);
+  }
+  printf("%s: %u bytes of flash read in %.3f s (%.0f bytes/s)\n", path, boot->appSize,
+         elapsed / 1e6, elapsed > 0 ? boot->appSize * 1e6 / elapsed : 0.0);
+}
+
+int main(int argc, char* argv[]) {
+  SerialOptions_init(&serialOptions);
+  parse_opts(argc, argv);
+
+  int serialfd = SerialOptions_open(&serialOptions);
+
+  BootInfo boot = { 0, 1, 0, 0, 0, 0 };
+  if (blockMode || verifyMode || dumpPath || switchBaud) {
+    boot = query_info(serialfd);
+    if (diffMode && boot.version < 4) {
+      fprintf(stderr, "bootloader protocol %u can't report page CRCs for --diff\n",
+              boot.version);
+      exit(1);
+    }
+    if (compressMode && boot.version < 6) {
+      fprintf(stderr, "bootloader protocol %u can't take compressed pages\n", boot.version);
+      exit(1);
+    }
+    if ((verifyMode || dumpPath) && boot.version < 5) {
+      fprintf(stderr, "bootloader protocol %u can't read back its flash\n", boot.version);
+      exit(1);
+    }
+    if (switchBaud) {
+      if (boot.version < 7) {
+        fprintf(stderr, "bootloader protocol %u can't switch baud rates\n", boot.version);
         exit(1);
-      } else {
-        printf("%02x", data);
       }
+      switch_baud(serialfd, &boot);
+    }
+
+    /*
+     * A page being programmed needs no RAM on the bootloader, so one more
+     * frame than it has buffers can be in flight without it stalling.
+     */
+    if (0 == window) {
+      window = boot.buffers + 1;
+    } else if (window > boot.buffers + 1u) {
+      fprintf(stderr, "window " SSIZET_FMT " is more than the bootloader's %u page buffers "
+              "allow; use at most %u\n", window, boot.buffers, boot.buffers + 1);
+      exit(1);
     }
+  }
 
-    /* Read the computer CRC and compare it to ours. */
-    uint8_t crc = readtty(serialfd);
-    if (crc != record.crc) {
-      fprintf(stderr, "bad crc response line " SSIZET_FMT ", expected %02x, got %02x\n",
-              lineno, record.crc, crc);
+  if (ihexFilePath[0]) {
+    /*
+     * Block mode sends whole pages, so the image is aligned to the
+     * bootloader's page size.  Unwritten bytes stay 0xFF, the value of
+     * erased flash.
+     */
+    uint32_t pagesize = blockMode ? boot.pagesize : 1;
+    IntelHexImage image;
+    if (-1 == IntelHexImage_load(&image, ihexFilePath, pagesize)) {
       exit(1);
+    }
+    if ((uint64_t)image.base + image.size > IMAGE_SIZE) {
+      fprintf(stderr, "%s: data up to %08x is beyond the bootloader's 64 KB reach\n",
+              ihexFilePath, image.base + image.size - 1);
+      exit(1);
+    }
+    if (verbose) {
+      printf("%s: %zu records, %u bytes at %04x\n", ihexFilePath, image.records,
+             image.size, image.base);
+    }
+
+    if (blockMode) {
+      static uint16_t pages[IMAGE_SIZE];
+      size_t npages = 0;
+      for (uint32_t addr = image.base; addr < image.base + image.size; addr += pagesize) {
+        if (IntelHexImage_pageUsed(&image, addr)) {
+          pages[npages++] = addr;
+        }
+      }
+      if (diffMode) {
+        npages = changed_pages(serialfd, &image, pages, npages, pagesize);
+      }
+      upload_pages(serialfd, &image, pages, npages, pagesize, window);
     } else {
-      printf("%02x", crc);
+      upload_records(serialfd, &image);
+    }
+
+    /* Leave the bootloader waiting, rather than start a damaged program. */
+    if (verifyMode) {
+      size_t bad = verify_image(serialfd, &image, boot.pagesize);
+      if (bad) {
+        fprintf(stderr, "%s: verify failed; " SSIZET_FMT " bytes differ\n", ihexFilePath,
+                bad);
+        exit(1);
+      }
+      printf("%s verified\n", ihexFilePath);
     }
-    printf("\n");
+
+    IntelHexImage_free(&image);
+  }
+
+  if (dumpPath) {
+    dump_flash(serialfd, &boot, dumpPath);
   }
 
   /* Inform the other end we're finished. */
-  writetty(serialfd, &"E", 1);
-  printf("%s uploaded!\n", ihexFilePath);
+  send_bytes(serialfd, "E", 1);
+  uint8_t pageWrites[2];
+  receive_bytes(serialfd, pageWrites, sizeof(pageWrites));
+  if (ihexFilePath[0]) {
+    printf("%s uploaded! (%u flash page writes)\n", ihexFilePath,
+           pageWrites[0] << 8 | pageWrites[1]);
+  }
 
   if (-1 == close(serialfd)) {
     perror("closing serial port\n");
   }
-
-  if (-1 == close(fd)) {
-    fprintf(stderr, "close %s: %s\n", ihexFilePath, strerror(errno));
-  }
 }
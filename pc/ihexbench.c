@@ -0,0 +1,285 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ *
+ * Times IntelHexImage_load() on a large .hex file: one given with -f, or
+ * one generated from random data, with an extended linear address record
+ * at every 64 KB, which is then checked against the loaded image.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "ihex.h"
+#include "io.h"
+
+/* Options that may be set from the command-line. */
+static const char* hexPath = NULL;
+static const char* keepPath = NULL;
+static uint32_t imageSize = 4u << 20;
+static unsigned recordLength = 16;
+static unsigned iterations = 5;
+static uint32_t pagesize = 128;
+static int lowercase;
+static int unixLines;
+static int baseline;
+
+/* Long options without a short equivalent. */
+#define OPT_LOWER 0x100
+#define OPT_LF    0x101
+
+void print_usage(const char *prog) {
+  printf("Usage: %s [-fksrnpb]\n", prog);
+  puts("  -f --file      time this .hex file instead of a generated one\n"
+       "  -k --keep      keep the generated file here\n"
+       "  -s --size      bytes of data to generate (default 4194304)\n"
+       "  -r --record    data bytes per generated record (default 16)\n"
+       "     --lower     generate lowercase hex digits\n"
+       "     --lf        end generated lines in LF rather than CR LF\n"
+       "  -n --iterations  times to load the file (default 5)\n"
+       "  -p --pagesize  page size to align the image to (default 128)\n"
+       "  -b --baseline  also time reading the file 2 bytes per read(2)\n");
+  exit(1);
+}
+
+static long parse_long(const char* name, long min, long max) {
+  char* end;
+  long val = strtol(optarg, &end, 0);
+  if ('\0' != *end || val < min || val > max) {
+    fprintf(stderr, "Invalid --%s given; must be %ld-%ld.\n", name, min, max);
+    exit(1);
+  }
+  return val;
+}
+
+void parse_opts(int argc, char *argv[]) {
+  static const struct option lopts[] = {
+    { "file",       1, 0, 'f' },
+    { "keep",       1, 0, 'k' },
+    { "size",       1, 0, 's' },
+    { "record",     1, 0, 'r' },
+    { "lower",      0, 0, OPT_LOWER },
+    { "lf",         0, 0, OPT_LF },
+    { "iterations", 1, 0, 'n' },
+    { "pagesize",   1, 0, 'p' },
+    { "baseline",   0, 0, 'b' },
+    { NULL,         0, 0, 0 },
+  };
+
+  while (1) {
+    int c = getopt_long(argc, argv, "f:k:s:r:n:p:b", lopts, NULL);
+    if (-1 == c) {
+      break;
+    }
+
+    switch (c) {
+    case 'f':
+      hexPath = optarg;
+      break;
+    case 'k':
+      keepPath = optarg;
+      break;
+    case 's':
+      imageSize = parse_long("size", 1, IHEX_MAX_SPAN);
+      break;
+    case 'r':
+      recordLength = parse_long("record", 1, 255);
+      break;
+    case OPT_LOWER:
+      lowercase = 1;
+      break;
+    case OPT_LF:
+      unixLines = 1;
+      break;
+    case 'n':
+      iterations = parse_long("iterations", 1, 1000);
+      break;
+    case 'p':
+      pagesize = parse_long("pagesize", 1, 1 << 16);
+      break;
+    case 'b':
+      baseline = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+}
+
+/**
+ * @brief Write one record, checksum included.
+ */
+static void put_record(FILE* f, uint8_t type, uint16_t offset, const uint8_t* data,
+                       unsigned length) {
+  static const char upper[] = "0123456789ABCDEF";
+  static const char lower[] = "0123456789abcdef";
+  const char* digits = lowercase ? lower : upper;
+  uint8_t header[] = { length, offset >> 8, offset & 0xFF, type };
+  uint8_t sum = 0;
+
+  fputc(':', f);
+  for (unsigned i = 0; i < sizeof(header) + length; ++i) {
+    uint8_t byte = i < sizeof(header) ? header[i] : data[i - sizeof(header)];
+    sum += byte;
+    fputc(digits[byte >> 4], f);
+    fputc(digits[byte & 0xF], f);
+  }
+  sum = -sum;
+  fputc(digits[sum >> 4], f);
+  fputc(digits[sum & 0xF], f);
+  fputs(unixLines ? "\n" : "\r\n", f);
+}
+
+/**
+ * @brief Write "size" bytes of "data" as a .hex file at "path".
+ */
+static void generate(const char* path, const uint8_t* data, uint32_t size) {
+  FILE* f = fopen(path, "w");
+  if (NULL == f) {
+    pabort("creating %s", path);
+  }
+
+  for (uint32_t addr = 0; addr < size; ) {
+    if (0 == (addr & 0xFFFF) && addr) {
+      uint8_t upper[] = { addr >> 24, (addr >> 16) & 0xFF };
+      put_record(f, 0x04, 0, upper, sizeof(upper));
+    }
+
+    /* Records stop at each 64 KB boundary, where the next 04 record goes. */
+    uint32_t length = recordLength;
+    if (length > 0x10000 - (addr & 0xFFFF)) {
+      length = 0x10000 - (addr & 0xFFFF);
+    }
+    if (length > size - addr) {
+      length = size - addr;
+    }
+    put_record(f, 0x00, addr & 0xFFFF, &data[addr], length);
+    addr += length;
+  }
+  put_record(f, 0x01, 0, NULL, 0);
+
+  if (0 != fclose(f)) {
+    pabort("writing %s", path);
+  }
+}
+
+/**
+ * @brief Time reading the file the way hexuploader once did, with a
+ * read(2) for every pair of characters.
+ * @return Elapsed microseconds.
+ */
+static int64_t time_baseline(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (-1 == fd) {
+    pabort("open %s", path);
+  }
+
+  int64_t start = monotonic_us();
+  char pair[2];
+  ssize_t got;
+  while ((got = read(fd, pair, sizeof(pair))) > 0) {
+  }
+  if (-1 == got) {
+    pabort("reading %s", path);
+  }
+  int64_t elapsed = monotonic_us() - start;
+
+  close(fd);
+  return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+  parse_opts(argc, argv);
+
+  uint8_t* data = NULL;
+  char tmpPath[] = "/tmp/ihexbench-XXXXXX";
+  const char* path = hexPath;
+  if (NULL == path) {
+    data = malloc(imageSize);
+    if (NULL == data) {
+      pabort("allocating %u bytes", imageSize);
+    }
+    uint32_t x = 2463534242u;
+    for (uint32_t i = 0; i < imageSize; ++i) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      data[i] = x;
+    }
+
+    if (keepPath) {
+      path = keepPath;
+    } else {
+      int fd = mkstemp(tmpPath);
+      if (-1 == fd) {
+        pabort("creating a temporary file");
+      }
+      close(fd);
+      path = tmpPath;
+    }
+    generate(path, data, imageSize);
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (-1 == fd) {
+    pabort("open %s", path);
+  }
+  off_t length = filesize(fd);
+  close(fd);
+
+  int64_t best = INT64_MAX;
+  int64_t total = 0;
+  IntelHexImage image;
+  for (unsigned i = 0; i < iterations; ++i) {
+    int64_t start = monotonic_us();
+    if (-1 == IntelHexImage_load(&image, path, pagesize)) {
+      exit(1);
+    }
+    int64_t elapsed = monotonic_us() - start;
+
+    best = elapsed < best ? elapsed : best;
+    total += elapsed;
+    if (i + 1 < iterations) {
+      IntelHexImage_free(&image);
+    }
+  }
+
+  printf("%s: %jd bytes, %zu records, image %u bytes at %08x\n", path,
+         (intmax_t)length, image.records, image.size, image.base);
+  printf("load: best %.3f ms, mean %.3f ms, %.1f MB/s\n", best / 1e3,
+         total / 1e3 / iterations, best > 0 ? (double)length / best : 0.0);
+
+  if (data) {
+    if (image.base != 0 || image.size < imageSize || memcmp(image.data, data, imageSize)) {
+      fprintf(stderr, "loaded image doesn't match the generated data\n");
+      exit(1);
+    }
+    printf("image matches the generated data\n");
+  }
+
+  if (baseline) {
+    int64_t elapsed = time_baseline(path);
+    printf("read(2) per 2 characters: %.3f ms, %.1f MB/s\n", elapsed / 1e3,
+           elapsed > 0 ? (double)length / elapsed : 0.0);
+  }
+
+  IntelHexImage_free(&image);
+  free(data);
+  if (NULL == hexPath && NULL == keepPath) {
+    unlink(tmpPath);
+  }
+  return 0;
+}
@@ -18,15 +18,18 @@
 #include <errno.h>
 #include <getopt.h>
 #include <assert.h>
+#include <stddef.h>
+#include <time.h>
 
-#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 
 #include "joystick.h"
 #include "io.h"
 #include "serial.h"
 
-#define CENTER_DEGREE 90
-
 #ifndef DEFAULT_JOYSTICK_DEVICE
 #  define DEFAULT_JOYSTICK_DEVICE "/dev/input/js0"
 #endif
@@ -34,42 +37,99 @@
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 
 /* Options that may be set from the command-line. */
-static char ttyDevicePath[PATH_MAX] = DEFAULT_TTY_DEVICE;
 static char jsDevicePath[PATH_MAX] = DEFAULT_JOYSTICK_DEVICE;
 static char jsOptionsPath[PATH_MAX] = "/etc/jsmaster.conf";
 static SerialOptions serialOptions;
+static int ackTimeoutMs = 100;
+static unsigned window = 4;
+static int deadband = 0;      // ticks
+static int tickMs = 0;
+static int threaded = 0;
+static int fastReplay = 0;
+
+/* Most commands that may be awaiting an ack at once. */
+#define MAX_WINDOW 64
 
+/* Longest command payload: a 'T' with ticks for every channel. */
+#define MAX_PAYLOAD (2 * JOYSTICK_MAX_CHANNELS)
+
+/*
+ * A command frame for the remote: [msgid, command, payload...].  The
+ * payload is already in network order, and its length depends on command.
+ */
 typedef struct {
   uint8_t msgid;        // msg correlation id
   uint8_t command;      // command for remote
-  uint16_t value;       // command argument value
-} __attribute__((packed)) Command;
+  uint8_t payload[MAX_PAYLOAD];
+  uint8_t length;       // payload bytes in use; not sent
+} Command;
+
+/**
+ * @brief Bytes "cmd" takes on the wire.
+ */
+static size_t Command_size(const Command* cmd) {
+  return offsetof(Command, payload) + cmd->length;
+}
 
 /**
- * @brief Prepare a Command structure for wire transmission, by making sure
- * all the bytes are in network order.
- * @param msgid
- * @param command
- * @param value
- * @return A command in network byte order.
+ * @brief Prepare a 'C' command, moving a single servo "channel" to "ticks".
+ * The msgid is filled in when the command is sent.
  */
-Command Command_init(char msgid, char command, uint16_t value) {
-  Command cmd = {msgid, command, htons(value)};
+static Command Command_channel(uint8_t channel, uint16_t ticks) {
+  Command cmd = { .command = 'C', .length = 3 };
+  cmd.payload[0] = channel;
+  cmd.payload[1] = ticks >> 8;
+  cmd.payload[2] = ticks & 0xFF;
   return cmd;
 }
 
+/**
+ * @brief Prepare a 'T' command, moving servos 0 through "count" - 1 at once.
+ * The msgid is filled in when the command is sent.
+ */
+static Command Command_ticks(const uint16_t* ticks, int count) {
+  Command cmd = { .command = 'T', .length = 2 * count };
+  for (int i = 0; i < count; ++i) {
+    cmd.payload[2 * i] = ticks[i] >> 8;
+    cmd.payload[2 * i + 1] = ticks[i] & 0xFF;
+  }
+  return cmd;
+}
+
+/* Long options without a short equivalent. */
+#define OPT_VMIN  0x100
+#define OPT_VTIME 0x101
+#define OPT_TICK  0x102
+#define OPT_THREADED 0x103
+#define OPT_FAST  0x104
+
 void print_usage(const char *prog) {
-  printf("Usage: %s [-Db25678e]\n", prog);
+  printf("Usage: %s [-tjcblTwd25678e]\n", prog);
   puts("  -t --tty      device to use (default /dev/ttyAMA0)\n"
-       "  -j --joystick device to use (default /dev/input/js0\n"
+       "  -j --joystick device or jstest recording to use (default /dev/input/js0)\n"
        "  -c --config   joystick mapping file (default /etc/jsmaster.conf)\n"
-       "  -b --baud     baud rate (default 9600)\n"
+       "  -b --baud     baud rate (default 9600); any rate the driver\n"
+       "                supports, e.g. 250000, 500000 or 1000000\n"
+       "  -l --low-latency  ask the serial driver not to batch input\n"
+       "     --vmin     bytes a read waits for (default 1)\n"
+       "     --vtime    read timeout between bytes, in 0.1s (default 0)\n"
        "  -2            use two stop bits instead of one\n"
        "  -5            bits per word\n"
        "  -6            bits per word\n"
        "  -7            bits per word\n"
        "  -8            bits per word (default)\n"
-       "  -e            even parity (default odd)\n");
+       "  -e            even parity (default odd)\n"
+       "  -T --timeout  ms to wait for a command's ack before resending\n"
+       "                it (default 100)\n"
+       "  -w --window   commands sent ahead of their acks (default 4, max 64)\n"
+       "  -d --deadband ticks a servo must move past before it is resent\n"
+       "                (default 0: any change)\n"
+       "     --tick     send on a fixed period of this many ms, at most one\n"
+       "                update per servo each (default 0: as events arrive)\n"
+       "     --threaded read the joystick on its own thread, so serial I/O\n"
+       "                never holds up draining its input\n"
+       "     --fast     replay a -j recording as fast as possible instead of\n"
+       "                in real time\n");
   exit(1);
 }
 
@@ -79,6 +139,15 @@ void parse_opts(int argc, char *argv[]) {
     { "joystick", 1, 0, 'j' },
     { "config",   1, 0, 'c' },
     { "baud",     1, 0, 'b' },
+    { "low-latency", 0, 0, 'l' },
+    { "vmin",     1, 0, OPT_VMIN },
+    { "vtime",    1, 0, OPT_VTIME },
+    { "tick",     1, 0, OPT_TICK },
+    { "threaded", 0, 0, OPT_THREADED },
+    { "fast",     0, 0, OPT_FAST },
+    { "timeout",  1, 0, 'T' },
+    { "window",   1, 0, 'w' },
+    { "deadband", 1, 0, 'd' },
     { NULL,       0, 0, '2' },
     { NULL,       0, 0, '5' },
     { NULL,       0, 0, '6' },
@@ -89,19 +158,19 @@ void parse_opts(int argc, char *argv[]) {
   };
 
   while (1) {
-    int c = getopt_long(argc, argv, "t:j:c:b:25678e", lopts, NULL);
+    int c = getopt_long(argc, argv, "t:j:c:b:T:w:d:25678el", lopts, NULL);
     if (-1 == c) {
       break;
     }
     
     switch (c) {
     case 't': {
-      size_t len = MIN(strlen(optarg), PATH_MAX);
-      if (!strncpy(ttyDevicePath, optarg, len)) {
+      size_t len = MIN(strlen(optarg), PATH_MAX - 1);
+      if (!strncpy(serialOptions.device, optarg, len)) {
         perror("Copying tty path.");
         abort();
       }
-      ttyDevicePath[len] = '\0';
+      serialOptions.device[len] = '\0';
       break;
     }
     case 'j': {
@@ -132,6 +201,25 @@ void parse_opts(int argc, char *argv[]) {
       serialOptions.baudrate = val;
       break;
     }
+    case 'l':
+      serialOptions.low_latency = 1;
+      break;
+    case OPT_VMIN:
+    case OPT_VTIME: {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 0 || val > UINT8_MAX) {
+        fprintf(stderr, "Invalid --%s given; must be 0-255.\n",
+                OPT_VMIN == c ? "vmin" : "vtime");
+        exit(1);
+      }
+
+      if (OPT_VMIN == c) {
+        serialOptions.vmin = val;
+      } else {
+        serialOptions.vtime = val;
+      }
+      break;
+    }
     case '2':
       serialOptions.stop_bits = 2;
       break;
@@ -144,6 +232,52 @@ void parse_opts(int argc, char *argv[]) {
     case 'e':
       serialOptions.parity = 'e';
       break;
+    case 'T': {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 1 || val > INT_MAX) {
+        fprintf(stderr, "Invalid timeout given.\n");
+        exit(1);
+      }
+
+      ackTimeoutMs = val;
+      break;
+    }
+    case 'w': {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 1 || val > MAX_WINDOW) {
+        fprintf(stderr, "Invalid window given; must be 1-%d.\n", MAX_WINDOW);
+        exit(1);
+      }
+
+      window = val;
+      break;
+    }
+    case OPT_THREADED:
+      threaded = 1;
+      break;
+    case OPT_FAST:
+      fastReplay = 1;
+      break;
+    case OPT_TICK: {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 1 || val > 1000) {
+        fprintf(stderr, "Invalid --tick given; must be 1-1000.\n");
+        exit(1);
+      }
+
+      tickMs = val;
+      break;
+    }
+    case 'd': {
+      long val = strtol(optarg, NULL, 10);
+      if (val < 0 || val > UINT16_MAX) {
+        fprintf(stderr, "Invalid deadband given; must be 0-%d.\n", UINT16_MAX);
+        exit(1);
+      }
+
+      deadband = val;
+      break;
+    }
     default:
       print_usage(argv[0]);
       exit(1);
@@ -151,23 +285,572 @@ void parse_opts(int argc, char *argv[]) {
   }
 }
 
+/*
+ * Period of the housekeeping timer, unless --tick sets it: status flushes,
+ * ack deadlines and coalesced axis updates.  It matches the servos' 50 Hz
+ * PWM frame, since they can't show more than one position per frame anyway.
+ */
+#define TICK_MS 20
+
+/* Commands waiting for a window slot; the oldest is dropped when full. */
+#define QUEUE_LEN 64
+
+/* The remote answers a bad frame with this, so it is never used as a msgid. */
+#define NACK_BYTE 0xFF
+
+/* Sending this many RESET_BYTEs realigns the remote's frame parser. */
+#define RESET_BYTE 0xFF
+#define NUM_RESET_BYTES 4
+
+/* Times a command is sent before we give up on it. */
+#define MAX_TRIES 3
+
+/*
+ * Servos on the remote, SERVO_CHANNELS in avr/lib/servo.h.  A 'T' command
+ * must carry exactly this many, and the remote's resync relies on no
+ * payload being longer than NUM_RESET_BYTES.
+ */
+#define REMOTE_CHANNELS 2
+_Static_assert(2 * REMOTE_CHANNELS <= NUM_RESET_BYTES, "'T' payload must not outlast a resync");
+
+typedef struct {
+  Command cmd;
+  int64_t deadline;     // when to retransmit
+  int64_t sentAt;       // monotonic_us of the latest transmission
+  uint32_t serial;      // commandSerial when queued
+  uint8_t tries;
+  uint8_t active;
+  uint8_t retired;      // may still draw a late ack, so sit out one wrap
+} Outstanding;
+
+typedef struct {
+  Command cmd;
+  uint32_t serial;
+} Queued;
+
+static Queued queue[QUEUE_LEN];
+static unsigned queueHead;
+static unsigned queueCount;
+
+/* Commands sent but not yet acked, indexed by msgid. */
+static Outstanding outstanding[256];
+static unsigned outstandingCount;
+static uint8_t nextMsgid;
+
+/*
+ * Every queued command gets the next serial, and each servo remembers the
+ * newest command that moves it, so a retransmit can tell whether newer
+ * values have replaced it on every servo it touches.
+ */
+static uint32_t commandSerial;
+static uint32_t channelSerial[JOYSTICK_MAX_CHANNELS];
+
+/**
+ * @brief Bitmask of the servos "cmd" moves.
+ */
+static unsigned command_channels(const Command* cmd) {
+  switch (cmd->command) {
+  case 'C': return 1u << cmd->payload[0];
+  case 'T': return (1u << (cmd->length / 2)) - 1;
+  default:  return 0;
+  }
+}
+
+/**
+ * @brief Give "cmd" a new serial and make it the newest command for its servos.
+ */
+static uint32_t claim_channels(const Command* cmd) {
+  unsigned channels = command_channels(cmd);
+  ++commandSerial;
+  for (int i = 0; i < JOYSTICK_MAX_CHANNELS; ++i) {
+    if (channels & (1 << i)) {
+      channelSerial[i] = commandSerial;
+    }
+  }
+  return commandSerial;
+}
+
+/**
+ * @brief Whether every servo "cmd" moves has had a newer command since.
+ */
+static int superseded(const Command* cmd, uint32_t serial) {
+  unsigned channels = command_channels(cmd);
+  for (int i = 0; i < JOYSTICK_MAX_CHANNELS; ++i) {
+    if ((channels & (1 << i)) && channelSerial[i] == serial) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static struct {
+  unsigned long sent;
+  unsigned long acked;
+  unsigned long retransmits;
+  unsigned long superseded;
+  unsigned long abandoned;
+  unsigned long nacks;
+  unsigned long stray;
+  unsigned long dropped;
+  unsigned long resyncs;
+  unsigned long reports;
+  unsigned long coalesced;
+  unsigned long ticks;
+  unsigned long overruns;
+  int64_t rttTotal;     // us, over every acked command
+  int64_t rttMax;
+  int64_t start;        // monotonic_us when the link opened
+} stats;
+
+static void print_stats(void) {
+  printf("\njoystick reports %lu, coalesced %lu\n", stats.reports, stats.coalesced);
+  if (tickMs) {
+    printf("ticks %lu, overruns %lu\n", stats.ticks, stats.overruns);
+  }
+  printf("sent %lu, acked %lu, retransmits %lu, superseded %lu, abandoned %lu\n"
+         "nacks %lu, stray acks %lu, dropped %lu, resyncs %lu\n",
+         stats.sent, stats.acked, stats.retransmits, stats.superseded, stats.abandoned,
+         stats.nacks, stats.stray, stats.dropped, stats.resyncs);
+
+  double elapsed = (monotonic_us() - stats.start) / 1e6;
+  printf("elapsed %.3f s, %.1f acked commands/s", elapsed, elapsed > 0 ? stats.acked / elapsed : 0);
+  if (stats.acked) {
+    printf(", ack latency avg %.2f ms, max %.2f ms",
+           stats.rttTotal / 1e3 / stats.acked, stats.rttMax / 1e3);
+  }
+  printf("\n");
+}
+
+/**
+ * @brief Pick a msgid that is neither NACK_BYTE nor still awaiting an ack.
+ * One retired since it was last used is passed over until the ids come round
+ * again, so a late ack for its old command can't ack a new one.
+ */
+static uint8_t allocate_msgid(void) {
+  while (NACK_BYTE == nextMsgid || outstanding[nextMsgid].active ||
+         outstanding[nextMsgid].retired) {
+    outstanding[nextMsgid].retired = 0;
+    ++nextMsgid;
+  }
+  return nextMsgid++;
+}
+
+/**
+ * @brief Send queued commands until the window is full, in a single write.
+ */
+static void fill_window(int serialfd) {
+  uint8_t batch[MAX_WINDOW * sizeof(Command)];
+  size_t count = 0;
+  size_t bytes = 0;
+  int64_t deadline = monotonic_ms() + ackTimeoutMs;
+  int64_t sentAt = monotonic_us();
+
+  while (outstandingCount < window && queueCount > 0) {
+    Queued* next = &queue[queueHead];
+    queueHead = (queueHead + 1) % QUEUE_LEN;
+    --queueCount;
+
+    next->cmd.msgid = allocate_msgid();
+    Outstanding* slot = &outstanding[next->cmd.msgid];
+    slot->cmd = next->cmd;
+    slot->deadline = deadline;
+    slot->serial = next->serial;
+    slot->sentAt = sentAt;
+    slot->tries = 1;
+    slot->active = 1;
+    ++outstandingCount;
+
+    memcpy(&batch[bytes], &next->cmd, Command_size(&next->cmd));
+    bytes += Command_size(&next->cmd);
+    ++count;
+  }
+
+  if (count > 0) {
+    if (-1 == writetty(serialfd, batch, bytes)) {
+      pabort("sending commands");
+    }
+    stats.sent += count;
+  }
+}
+
+/**
+ * @brief Queue "cmd" for sending, and send it right away if the window has room.
+ * The msgid is assigned when the command is actually sent.
+ */
+static void enqueue(int serialfd, Command cmd) {
+  /* A value still waiting for the window just takes the newer position. */
+  for (unsigned i = 0; i < queueCount; ++i) {
+    Queued* q = &queue[(queueHead + i) % QUEUE_LEN];
+    if (q->cmd.command == cmd.command && command_channels(&q->cmd) == command_channels(&cmd)) {
+      memcpy(q->cmd.payload, cmd.payload, cmd.length);
+      q->serial = claim_channels(&cmd);
+      ++stats.coalesced;
+      return;
+    }
+  }
+
+  if (QUEUE_LEN == queueCount) {
+    queueHead = (queueHead + 1) % QUEUE_LEN;
+    --queueCount;
+    ++stats.dropped;
+  }
+
+  Queued* q = &queue[(queueHead + queueCount) % QUEUE_LEN];
+  q->cmd = cmd;
+  q->serial = claim_channels(&cmd);
+  ++queueCount;
+  fill_window(serialfd);
+}
+
+/**
+ * @brief Drain whatever acks the remote has sent so far, without blocking.
+ */
+static void receive_acks(int serialfd) {
+  uint8_t acks[64];
+  ssize_t got;
+
+  while ((got = read(serialfd, acks, sizeof(acks))) > 0) {
+    for (ssize_t i = 0; i < got; ++i) {
+      if (NACK_BYTE == acks[i]) {
+        /* Can't tell which frame was bad; its timeout will retransmit it. */
+        ++stats.nacks;
+        continue;
+      }
+
+      Outstanding* slot = &outstanding[acks[i]];
+      if (!slot->active) {
+        /* A late ack for something already retransmitted or given up on. */
+        ++stats.stray;
+        continue;
+      }
+
+      /* Every transmission may be acked, so a resent command has more to come. */
+      slot->active = 0;
+      slot->retired = slot->tries > 1;
+      --outstandingCount;
+      ++stats.acked;
+      int64_t rtt = monotonic_us() - slot->sentAt;
+      stats.rttTotal += rtt;
+      if (rtt > stats.rttMax) {
+        stats.rttMax = rtt;
+      }
+      const uint8_t* p = slot->cmd.payload;
+      if ('C' == slot->cmd.command) {
+        printf("Command: %u, C, channel %u, %u ticks, in flight %u    \r",
+               slot->cmd.msgid, p[0], p[1] << 8 | p[2], outstandingCount);
+      } else {
+        printf("Command: %u, T, %u/%u ticks, in flight %u    \r",
+               slot->cmd.msgid, p[0] << 8 | p[1], p[2] << 8 | p[3], outstandingCount);
+      }
+    }
+  }
+
+  if (0 == got) {
+    fprintf(stderr, "Serial device closed.\n");
+    exit(1);
+  }
+  if (EAGAIN != errno && EINTR != errno) {
+    pabort("reading ack");
+  }
+
+  fill_window(serialfd);
+}
+
+/**
+ * @brief Retransmit, or give up on, every command whose ack is overdue.
+ * Commands for a servo that has since been given a newer value are dropped
+ * instead, since resending a stale position would only move it backwards.
+ */
+static void check_ack_timeouts(int serialfd) {
+  int64_t now = monotonic_ms();
+  uint8_t batch[MAX_WINDOW * sizeof(Command)];
+  size_t count = 0;
+  size_t bytes = 0;
+
+  for (unsigned id = 0; id < 256; ++id) {
+    Outstanding* slot = &outstanding[id];
+    if (!slot->active || now < slot->deadline) {
+      continue;
+    }
+
+    if (superseded(&slot->cmd, slot->serial)) {
+      ++stats.superseded;
+    } else if (slot->tries >= MAX_TRIES) {
+      printf("\nNo ack for command %u after %d tries\n", slot->cmd.msgid, slot->tries);
+      ++stats.abandoned;
+    } else {
+      ++slot->tries;
+      slot->deadline = now + ackTimeoutMs;
+      slot->sentAt = monotonic_us();
+      memcpy(&batch[bytes], &slot->cmd, Command_size(&slot->cmd));
+      bytes += Command_size(&slot->cmd);
+      ++count;
+      continue;
+    }
+
+    slot->active = 0;
+    slot->retired = 1;
+    --outstandingCount;
+  }
+
+  if (count > 0) {
+    /* Lost bytes may have left the remote mid-frame; realign it first. */
+    uint8_t reset[NUM_RESET_BYTES];
+    memset(reset, RESET_BYTE, sizeof(reset));
+    struct iovec iov[] = {
+      { reset, sizeof(reset) },
+      { batch, bytes },
+    };
+    if (-1 == writettyv(serialfd, iov, 2, 0)) {
+      pabort("retransmitting commands");
+    }
+    ++stats.resyncs;
+    stats.retransmits += count;
+  }
+
+  fill_window(serialfd);
+}
+
+typedef struct {
+  const ChannelMap* map;
+  int16_t value;        // latest reading of map->axis
+  uint8_t pending;      // value has not been considered for sending yet
+  int ticks;            // last ticks queued, or -1 before the first
+  int64_t lastSent;     // when those ticks were queued
+} Output;
+
+/* One per configured channel, in jsOpts order. */
+static Output outputs[JOYSTICK_MAX_CHANNELS];
+static int noutputs;
+
+/* Whether the outputs are exactly the remote's channels, so 'T' can set them all. */
+static int useTicksCommand;
+
+/* Timestamp, in ms, of the latest report of a --fast replay. */
+static int64_t replayMs;
+
+/**
+ * @brief The clock outputs are paced by: the wall clock, or the recording's
+ * own timestamps in a --fast replay, so that it sends as many commands as
+ * it would in real time, only sooner.
+ */
+static int64_t output_clock(void) {
+  return fastReplay ? replayMs : monotonic_ms();
+}
+
+/**
+ * @brief Decide whether the latest value of "out" moved it far enough to send.
+ * The limits and the center are always sent, so letting go of the stick is
+ * never lost inside the deadband.
+ * @return The ticks to send, or -1 to leave the servo where it is.
+ */
+static int output_update(Output* out) {
+  out->pending = 0;
+
+  int ticks = ChannelMap_ticks(out->map, out->value);
+  int moved = abs(ticks - out->ticks);
+  int landmark = out->map->min == ticks || out->map->max == ticks ||
+                 ChannelMap_center(out->map) == ticks;
+  if (out->ticks >= 0 && (0 == moved || (moved <= deadband && !landmark))) {
+    ++stats.coalesced;
+    return -1;
+  }
+
+  return ticks;
+}
+
+/**
+ * @brief Queue the latest value of every pending output that last sent at
+ * least "minAge" ms ago.  When more than one servo moves and 'T' can reach
+ * them all, they share one command.
+ */
+static void send_outputs(int serialfd, int64_t minAge) {
+  int64_t now = output_clock();
+  int ticks[JOYSTICK_MAX_CHANNELS];
+  int moving = 0;
+
+  for (int i = 0; i < noutputs; ++i) {
+    ticks[i] = -1;
+    if (outputs[i].pending && now - outputs[i].lastSent >= minAge) {
+      ticks[i] = output_update(&outputs[i]);
+    }
+    if (ticks[i] >= 0) {
+      ++moving;
+    }
+  }
+
+  if (moving > 1 && useTicksCommand) {
+    /* 'T' sets every servo, so any that didn't move is resent as is. */
+    uint16_t all[REMOTE_CHANNELS];
+    for (int i = 0; i < noutputs; ++i) {
+      if (ticks[i] < 0) {
+        ticks[i] = outputs[i].ticks >= 0 ? outputs[i].ticks : ChannelMap_center(outputs[i].map);
+      }
+      all[outputs[i].map->channel] = ticks[i];
+      outputs[i].ticks = ticks[i];
+      outputs[i].lastSent = now;
+    }
+    enqueue(serialfd, Command_ticks(all, REMOTE_CHANNELS));
+    return;
+  }
+
+  for (int i = 0; i < noutputs; ++i) {
+    if (ticks[i] >= 0) {
+      outputs[i].ticks = ticks[i];
+      outputs[i].lastSent = now;
+      enqueue(serialfd, Command_channel(outputs[i].map->channel, ticks[i]));
+    }
+  }
+}
+
+/**
+ * @brief Mark every output whose axis moved in "state" as pending.
+ * All the axes that moved in one report become pending together, so they
+ * go out in the same command.
+ */
+static void apply_state(const JoystickState* state) {
+  ++stats.reports;
+  for (int i = 0; i < noutputs; ++i) {
+    int16_t value = state->axes[outputs[i].map->axis];
+    if (value == outputs[i].value && outputs[i].ticks >= 0) {
+      continue;
+    }
+    if (outputs[i].pending) {
+      ++stats.coalesced;
+    }
+    outputs[i].value = value;
+    outputs[i].pending = 1;
+  }
+}
+
+/**
+ * @brief Apply one report of a --fast replay, and send whatever it moved as
+ * the real-time loop would have: the ticks that fell since the previous
+ * report go first, then the report itself as it arrives.
+ */
+static void replay_report(int serialfd, const JoystickState* state) {
+  int64_t period = tickMs ? tickMs : TICK_MS;
+  int64_t tick = state->time - state->time % period;
+  if (replayMs < tick) {
+    replayMs = tick;
+    send_outputs(serialfd, 0);
+  }
+
+  replayMs = state->time;
+  apply_state(state);
+  if (!tickMs) {
+    send_outputs(serialfd, TICK_MS);
+  }
+}
+
+/**
+ * @brief Apply every complete joystick report to the outputs it drives.
+ * Without --tick, an output that hasn't sent anything for a whole tick sends
+ * right away; otherwise only its latest value is kept for the next tick.
+ * A --fast replay is always ready, so it is taken one report per call.
+ * @return 0, or -1 once a replayed recording has run out.
+ */
+static int read_joystick(const Joystick* js, int serialfd) {
+  static JoystickState state;
+  int got;
+
+  if (fastReplay) {
+    if (1 == (got = Joystick_readState(js, &state))) {
+      replay_report(serialfd, &state);
+    }
+  } else {
+    while (1 == (got = Joystick_readState(js, &state))) {
+      apply_state(&state);
+    }
+  }
+
+  if (-1 == got && ENODATA != errno) {
+    pabort("Error getting js event");
+  }
+
+  if (!tickMs && !fastReplay) {
+    send_outputs(serialfd, TICK_MS);
+  }
+  return got < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Like read_joystick, but taking the latest state from the --threaded
+ * reader, skipping any reports it published in between.
+ */
+static int read_reader(JoystickReader* reader, int serialfd) {
+  /* Clear the wakeup first, so a state published meanwhile wakes us again. */
+  uint64_t count;
+  if (-1 == read(JoystickReader_fd(reader), &count, sizeof(count)) && EAGAIN != errno) {
+    pabort("reading joystick reader");
+  }
+
+  /*
+   * Go again after a fresh state, since the reader may have stopped after
+   * it.  A --fast replay is read in step with us, one report per wakeup.
+   */
+  JoystickState state;
+  int got;
+  if (fastReplay) {
+    if (1 == (got = JoystickReader_snapshot(reader, &state))) {
+      replay_report(serialfd, &state);
+    }
+  } else {
+    while (1 == (got = JoystickReader_snapshot(reader, &state))) {
+      apply_state(&state);
+    }
+  }
+
+  if (-1 == got && ENODATA != errno) {
+    pabort("Error getting js event");
+  }
+
+  if (!tickMs && !fastReplay) {
+    send_outputs(serialfd, TICK_MS);
+  }
+  return got < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Register "fd" with the epoll instance for input readiness.
+ */
+static void watch_fd(int epollfd, int fd) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+  if (-1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev)) {
+    pabort("watching fd %d", fd);
+  }
+}
+
 int main(int argc, char* argv[]) {
   SerialOptions_init(&serialOptions);
   parse_opts(argc, argv);
 
   JoystickOptions jsOpts = JoystickOptions_init(jsDevicePath, jsOptionsPath);
-  printf("device: %s\ny_left:%d\ny_right:%d\n",
-         jsOpts.devicepath, jsOpts.y_left, jsOpts.y_right);
+  jsOpts.fastReplay = fastReplay;
+  printf("device: %s\n", jsOpts.devicepath);
 
   Joystick js = Joystick_open(&jsOpts);
 
-  /* Check that axes are in valid ranges. */
-  if (jsOpts.y_left < 0 || jsOpts.y_left >= js.naxes) {
-    fprintf(stderr, "y_left=%d out of range=[0,%d] of axes", jsOpts.y_left, js.naxes);
-  }
-  if (jsOpts.y_right < 0 || jsOpts.y_right >= js.naxes) {
-    fprintf(stderr, "y_right=%d out of range=[0,%d] of axes", jsOpts.y_right, js.naxes);
+  /* Check that axes and channels are in valid ranges. */
+  unsigned channels = 0;
+  for (int i = 0; i < jsOpts.nchannels; ++i) {
+    const ChannelMap* map = &jsOpts.channels[i];
+    printf("axis %d -> channel %d: %u-%u ticks, center %u%s\n", map->axis, map->channel,
+           map->min, map->max, ChannelMap_center(map), map->invert ? ", inverted" : "");
+    if (map->axis >= js.naxes) {
+      fprintf(stderr, "axis=%d out of range=[0,%d] of axes\n", map->axis, js.naxes - 1);
+      exit(1);
+    }
+    if (map->channel >= REMOTE_CHANNELS) {
+      fprintf(stderr, "channel=%d out of range=[0,%d] of the remote's channels\n",
+              map->channel, REMOTE_CHANNELS - 1);
+      exit(1);
+    }
+    channels |= 1u << map->channel;
+
+    outputs[noutputs++] = (Output){ .map = map, .ticks = -1 };
   }
+  useTicksCommand = (1u << REMOTE_CHANNELS) - 1 == channels;
 
   printf("Joystick driver version: %d.%d.%d\n",
          js.driverVersion >> 16, (js.driverVersion >> 8) & 0xff, js.driverVersion & 0xff);
@@ -175,32 +858,141 @@ int main(int argc, char* argv[]) {
 
   int serialfd = SerialOptions_open(&serialOptions);
 
+  /* Acks are drained as they arrive, so reads must never block the loop. */
+  int flags = fcntl(serialfd, F_GETFL);
+  if (-1 == flags || -1 == fcntl(serialfd, F_SETFL, flags | O_NONBLOCK)) {
+    pabort("making %s non-blocking", serialOptions.device);
+  }
+
+  int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (-1 == timerfd) {
+    pabort("creating timer");
+  }
+
+  /*
+   * The first deadline is absolute, and the kernel advances it by whole
+   * periods, so the ticks don't drift with however long we take to answer.
+   */
+  long period = tickMs ? tickMs : TICK_MS;
+  struct itimerspec tick = {
+    .it_interval = { period / 1000, (period % 1000) * 1000000L },
+  };
+  if (-1 == clock_gettime(CLOCK_MONOTONIC, &tick.it_value)) {
+    pabort("reading clock");
+  }
+  tick.it_value.tv_nsec += tick.it_interval.tv_nsec;
+  tick.it_value.tv_sec += tick.it_interval.tv_sec + tick.it_value.tv_nsec / 1000000000L;
+  tick.it_value.tv_nsec %= 1000000000L;
+  if (-1 == timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &tick, NULL)) {
+    pabort("arming timer");
+  }
+
+  /* Take SIGINT and SIGTERM through the loop so we can report before exiting. */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (-1 == sigprocmask(SIG_BLOCK, &signals, NULL)) {
+    pabort("blocking signals");
+  }
+  int sigfd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (-1 == sigfd) {
+    pabort("creating signalfd");
+  }
+
+  int epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (-1 == epollfd) {
+    pabort("creating epoll instance");
+  }
+  JoystickReader* reader = NULL;
+  int inputfd = js.fd;
+  if (threaded) {
+    reader = JoystickReader_start(&js);
+    if (NULL == reader) {
+      pabort("starting joystick reader");
+    }
+    inputfd = JoystickReader_fd(reader);
+  }
+
+  watch_fd(epollfd, inputfd);
+  int inputDone = 0;
+  int inputPaused = 0;
+  stats.start = monotonic_us();
+  watch_fd(epollfd, serialfd);
+  watch_fd(epollfd, timerfd);
+  watch_fd(epollfd, sigfd);
+
   while (1) {
-    JoystickEvent jsevent;
-
-    while (1 == Joystick_getEvent(&js, &jsevent)) {
-      switch (jsevent.type & ~JSE_INIT) {
-      case JSE_AXIS: {
-        if (jsOpts.y_left == jsevent.number || jsOpts.y_right == jsevent.number) {
-          // TODO send the command aio_write
-          static uint8_t msgid = 0xFF;
-          Command cmd = Command_init(++msgid, jsOpts.y_left == jsevent.number ? 'L' : 'R',
-                                     CENTER_DEGREE + (CENTER_DEGREE * -jsevent.value) / 0x7FFF);
-          writetty(serialfd, &cmd, sizeof(Command));
-
-          uint8_t ack = readtty(serialfd);
-          printf("Command: %u, %u, %c, %d, %d\r", cmd.msgid, ack, cmd.command, ntohs(cmd.value), -jsevent.value);
-        }
+    struct epoll_event events[4];
+    int ready = epoll_wait(epollfd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (-1 == ready) {
+      if (EINTR == errno) {
+        continue;
+      }
+      pabort("waiting for events");
+    }
 
-        break;
+    for (int i = 0; i < ready; ++i) {
+      int fd = events[i].data.fd;
+
+      if (fd == serialfd) {
+        receive_acks(serialfd);
+      } else if (fd == inputfd) {
+        int ended = reader ? read_reader(reader, serialfd) : read_joystick(&js, serialfd);
+        if (ended) {
+          /* A recording ran out: send what is left, then wait for the acks. */
+          if (-1 == epoll_ctl(epollfd, EPOLL_CTL_DEL, inputfd, NULL)) {
+            pabort("unwatching joystick");
+          }
+          inputDone = 1;
+          send_outputs(serialfd, 0);
+        }
+      } else if (fd == timerfd) {
+        uint64_t expirations = 0;
+        if (-1 == read(timerfd, &expirations, sizeof(expirations)) && EAGAIN != errno) {
+          pabort("reading timer");
+        }
+        /* Deadlines that passed while we were busy are skipped, not replayed. */
+        if (expirations > 0) {
+          ++stats.ticks;
+          stats.overruns += expirations - 1;
+        }
+        /* A --fast replay keeps its own ticks, in replay_report(). */
+        if (!fastReplay) {
+          send_outputs(serialfd, 0);
+        }
+        check_ack_timeouts(serialfd);
+        fflush(stdout);
+      } else if (fd == sigfd) {
+        if (reader) {
+          JoystickReader_stop(reader);
+        }
+        print_stats();
+        return 0;
       }
+    }
+
+    /*
+     * A --fast replay is always ready, so the link sets its pace: stop
+     * reading while commands are waiting for the window.
+     */
+    if (fastReplay && !inputDone) {
+      int full = queueCount > 0 || outstandingCount >= window;
+      if (full != inputPaused) {
+        struct epoll_event ev = { .events = full ? 0 : EPOLLIN, .data.fd = inputfd };
+        if (-1 == epoll_ctl(epollfd, EPOLL_CTL_MOD, inputfd, &ev)) {
+          pabort("pausing joystick");
+        }
+        inputPaused = full;
       }
     }
 
-    if (EAGAIN != errno) {
-      pabort("Error getting js event");
+    if (inputDone && 0 == queueCount && 0 == outstandingCount) {
+      if (reader) {
+        JoystickReader_stop(reader);
+      }
+      print_stats();
+      return 0;
     }
-    
-    fflush(stdout);
   }
 }
@@ -19,100 +19,95 @@
 #include <linux/limits.h>
 #include <errno.h>
 #include <getopt.h>
+#include <poll.h>
 
-#include <linux/joystick.h>
-
-typedef struct JoystickOptions {
-  char device[PATH_MAX];
-} JoystickOptions;
+#include "joystick.h"
+#include "io.h"
 
 #ifndef DEFAULT_JOYSTICK_DEVICE
 #  define DEFAULT_JOYSTICK_DEVICE "/dev/input/js0"
 #endif
 
-void JoystickOptions_init(JoystickOptions* opts) {
-  strncpy(opts->device, DEFAULT_JOYSTICK_DEVICE, PATH_MAX);
-}
+/* Joystick events taken per read(2). */
+#define JS_EVENT_BATCH 64
 
-static void pabort(const char *s) {
-  perror(s);
-  abort();
+/*
+ * Only the device path is used; jstest shows every axis and button, so it
+ * doesn't need a channel mapping.
+ */
+void JoystickOptions_default(JoystickOptions* opts) {
+  memset(opts, 0, sizeof(*opts));
+  strncpy(opts->devicepath, DEFAULT_JOYSTICK_DEVICE, PATH_MAX);
 }
 
+/* Where -r records the events to, if anywhere. */
+static const char* recordPath = NULL;
+
 void print_usage(const char *prog) {
-  printf("Usage: %s [-Db25678e]\n", prog);
-  puts("  -D --device   device to use (default /dev/ttyAMA0)\n");
+  printf("Usage: %s [-Dr]\n", prog);
+  puts("  -D --device   device or recording to use (default /dev/input/js0)\n"
+       "  -r --record   also write every event to this file, for jsmaster\n"
+       "                to replay\n");
   exit(1);
 }
 
-JoystickOptions parse_opts(int argc, char *argv[]) {
-  JoystickOptions options;
-  JoystickOptions_init(&options);
+const JoystickOptions* parse_opts(int argc, char *argv[]) {
+  static JoystickOptions options;
+  JoystickOptions_default(&options);
   
   static const struct option lopts[] = {
     { "device",  1, 0, 'D' },
+    { "record",  1, 0, 'r' },
     { NULL, 0, 0, 0 },
   };
 
   while (1) {
-    int c = getopt_long(argc, argv, "D:b:25678e", lopts, NULL);
+    int c = getopt_long(argc, argv, "D:r:b:25678e", lopts, NULL);
     if (-1 == c) {
       break;
     }
     
     switch (c) {
     case 'D':
-      if (!strncpy(options.device, optarg,
-                   PATH_MAX < strlen(optarg) ? PATH_MAX : strlen(optarg))) {
+      if (!strncpy(options.devicepath, optarg,
+                   PATH_MAX - 1 < strlen(optarg) ? PATH_MAX - 1 : strlen(optarg))) {
         perror("Copying device to options.");
         abort();
       }
       break;
+    case 'r':
+      recordPath = optarg;
+      break;
     default:
       print_usage(argv[0]);
       exit(1);
     }
   }
 
-  return options;
+  return &options;
 }
 
 int main(int argc, char* argv[]) {
-  JoystickOptions opts = parse_opts(argc, argv);
-  
-  int fd = open(opts.device, O_RDONLY | O_NONBLOCK);
-  if (-1 == fd) {
-    pabort("can't open device");
-  }
-
-  int version;
-  if (-1 == ioctl(fd, JSIOCGVERSION, &version)) {
-    pabort("Error getting driver version");
-  }
-
-  char name[128];
-  if (-1 == ioctl(fd, JSIOCGNAME(sizeof(name)), name)) {
-    pabort("Error getting joystick name");
-  }
-
-  uint8_t naxes;
-  if (-1 == ioctl(fd, JSIOCGAXES, &naxes)) {
-    pabort("Error getting number joystick axes");
-  }
-
-  uint8_t nbuttons;
-  if (-1 == ioctl(fd, JSIOCGBUTTONS, &nbuttons)) {
-    pabort("Error getting number joystick buttons");
-  }
+  Joystick js = Joystick_open(parse_opts(argc, argv));
+  int naxes = (uint8_t)js.naxes;
+  int nbuttons = (uint8_t)js.nbuttons;
 
   printf("Driver version: %d.%d.%d\n",
-         version >> 16, (version >> 8) & 0xff, version & 0xff);
+         js.driverVersion >> 16, (js.driverVersion >> 8) & 0xff, js.driverVersion & 0xff);
   printf("{\n"
          "\tName: %s\n"
          "\t# axes: %d\n"
          "\t# buttons: %d\n"
          "}\n",
-         name, naxes, nbuttons);
+         js.name, naxes, nbuttons);
+
+  int recordfd = -1;
+  if (recordPath) {
+    recordfd = open(recordPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == recordfd || -1 == Joystick_writeRecordHeader(&js, recordfd)) {
+      pabort("Error starting recording %s", recordPath);
+    }
+  }
 
   int* axes;
   char* buttons;
@@ -121,49 +116,59 @@ int main(int argc, char* argv[]) {
   buttons = calloc(nbuttons, sizeof(char));
   
   while (1) {
-    struct js_event jsevent;
-
-    /* fcntl(fd, F_SETFL, O_NONBLOCK); */
-    while (read(fd, &jsevent, sizeof(struct js_event)) ==
-           sizeof(struct js_event)) {
-      switch (jsevent.type & ~JS_EVENT_INIT) {
-      case JS_EVENT_AXIS:
-        axes[jsevent.number] = jsevent.value;
-        break;
-      case JS_EVENT_BUTTON:
-        buttons[jsevent.number] = jsevent.value;
-        break;
+    struct pollfd pfd = { js.fd, POLLIN, 0 };
+    if (-1 == poll(&pfd, 1, -1)) {
+      if (EINTR == errno) {
+        continue;
       }
+      pabort("Error waiting for js events");
+    }
 
-      printf("\r");
-      
-      // Print axis info
-      printf("Axes: [");
-      if (naxes) {
-        for (unsigned char i = 0; i < naxes; ++i) {
-          printf("%2d:%6d%c", i, axes[i], naxes-1 == i ? ']' : ' ');
-        }
+    JoystickEvent events[JS_EVENT_BATCH];
+    int got = Joystick_getEvents(&js, events, JS_EVENT_BATCH);
+    if (-1 == got) {
+      if (ENODATA == errno) {
+        printf("\n");
+        return 0;
+      }
+      pabort("Error getting js event");
+    }
+
+    if (-1 != recordfd && got > 0) {
+      ssize_t len = got * sizeof(JoystickEvent);
+      if (len != write(recordfd, events, len)) {
+        pabort("Error recording to %s", recordPath);
       }
+    }
 
-      // Print button info
-      printf(" Buttons: [");
-      if (nbuttons) {
-        for (unsigned char i = 0; i < nbuttons; ++i) {
-          printf("%2d:%s%c", i, buttons[i] ? "on" : "off",
-                 nbuttons-1 == i ? ']' : ' ');
-        }
+    for (int i = 0; i < got; ++i) {
+      switch (events[i].type & ~JSE_INIT) {
+      case JSE_AXIS:
+        axes[events[i].number] = events[i].value;
+        break;
+      case JSE_BUTTON:
+        buttons[events[i].number] = events[i].value;
+        break;
       }
+    }
 
-      struct timespec tv = {0, 100*1000};
-      if (-1 == nanosleep(&tv, NULL)) {
-        if (EINTR != errno) {
-          pabort("Error sleeping");
-        }
+    printf("\r");
+      
+    // Print axis info
+    printf("Axes: [");
+    if (naxes) {
+      for (int i = 0; i < naxes; ++i) {
+        printf("%2d:%6d%c", i, axes[i], naxes-1 == i ? ']' : ' ');
       }
     }
 
-    if (EAGAIN != errno) {
-      pabort("Error getting js event");
+    // Print button info
+    printf(" Buttons: [");
+    if (nbuttons) {
+      for (int i = 0; i < nbuttons; ++i) {
+        printf("%2d:%s%c", i, buttons[i] ? "on" : "off",
+               nbuttons-1 == i ? ']' : ' ');
+      }
     }
     
     fflush(stdout);
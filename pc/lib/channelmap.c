@@ -0,0 +1,71 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ */
+
+#include "channelmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+ChannelMap ChannelMap_init(int axis, int channel) {
+  ChannelMap map = {
+    .axis = axis,
+    .channel = channel,
+    .invert = 0,
+    .expo = 0.0,
+    .trim = 0,
+    .min = CHANNEL_TICKS_MIN,
+    .max = CHANNEL_TICKS_MAX,
+    .table = NULL,
+  };
+  return map;
+}
+
+void ChannelMap_compile(ChannelMap* map) {
+  if (map->min >= map->max) {
+    fprintf(stderr, "axis %d: min %u must be below max %u\n", map->axis, map->min, map->max);
+    abort();
+  }
+  if (map->expo < 0.0 || map->expo > 1.0) {
+    fprintf(stderr, "axis %d: expo %g must be within [0,1]\n", map->axis, map->expo);
+    abort();
+  }
+
+  double center = (map->min + map->max) / 2.0 + map->trim;
+  if (center <= map->min || center >= map->max) {
+    fprintf(stderr, "axis %d: trim %d leaves no travel on one side\n", map->axis, map->trim);
+    abort();
+  }
+
+  free(map->table);
+  map->table = malloc(CHANNEL_TABLE_SIZE * sizeof(uint16_t));
+  assert(map->table);
+
+  for (unsigned i = 0; i < CHANNEL_TABLE_SIZE; ++i) {
+    /* Undo the index bias in ChannelMap_ticks. */
+    int value = (int)i - 0x8000;
+
+    double x = value / 32767.0;
+    if (x < -1.0) {
+      x = -1.0;
+    }
+    if (map->invert) {
+      x = -x;
+    }
+
+    double y = (1.0 - map->expo) * x + map->expo * x * x * x;
+    double ticks = center + y * (y >= 0 ? map->max - center : center - map->min);
+    map->table[i] = (uint16_t)(ticks + 0.5);
+  }
+}
+
+void ChannelMap_free(ChannelMap* map) {
+  free(map->table);
+  map->table = NULL;
+}
@@ -0,0 +1,80 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Default output limits, in servo compare ticks.  These are what
+ * SERVO_TICKS_MIN and SERVO_TICKS_MAX in avr/lib/servo.h come to on an
+ * 8 MHz part; set "min" and "max" per channel for anything else.
+ */
+#define CHANNEL_TICKS_MIN 500
+#define CHANNEL_TICKS_MAX 1000
+
+/* Entries in a compiled table: one for every int16_t axis value. */
+#define CHANNEL_TABLE_SIZE 0x10000
+
+/*
+ * How one joystick axis drives one servo channel.  Raw axis values are
+ * shaped by invert and expo, then scaled to [min, max] around a center of
+ * (min + max) / 2 + trim.
+ */
+typedef struct ChannelMap {
+  int axis;             // joystick axis number
+  int channel;          // servo channel on the remote
+  int invert;           // non-zero to reverse the axis
+  double expo;          // 0 is linear, 1 is fully cubic for finer control near center
+  int trim;             // ticks added to the center position
+  uint16_t min;         // output limits in ticks
+  uint16_t max;
+  uint16_t* table;      // ticks for each axis value, see ChannelMap_ticks
+} ChannelMap;
+
+/**
+ * @brief Fill in the defaults for a map from "axis" to "channel": linear,
+ * uninverted, untrimmed, over the full default tick range.
+ */
+ChannelMap ChannelMap_init(int axis, int channel);
+
+/**
+ * @brief Precompute the output ticks for every possible axis value, so
+ * mapping an event costs a single table lookup.  Aborts if the map's
+ * settings don't make sense.
+ * @param map
+ */
+void ChannelMap_compile(ChannelMap* map);
+
+/**
+ * @brief Release the table built by ChannelMap_compile.
+ */
+void ChannelMap_free(ChannelMap* map);
+
+/**
+ * @brief Look up the output ticks for a raw axis "value".
+ */
+static inline uint16_t ChannelMap_ticks(const ChannelMap* map, int16_t value) {
+  return map->table[(uint16_t)value ^ 0x8000];
+}
+
+/**
+ * @brief The ticks an axis at rest maps to.
+ */
+static inline uint16_t ChannelMap_center(const ChannelMap* map) {
+  return ChannelMap_ticks(map, 0);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,26 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ */
+
+#include "crc16.h"
+
+uint16_t crc16_update(uint16_t crc, uint8_t data) {
+  crc ^= (uint16_t)data << 8;
+  for (int i = 0; i < 8; ++i) {
+    crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+uint16_t crc16(uint16_t crc, const void* data, size_t length) {
+  const uint8_t* bytes = data;
+  for (size_t i = 0; i < length; ++i) {
+    crc = crc16_update(crc, bytes[i]);
+  }
+  return crc;
+}
@@ -0,0 +1,41 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ *
+ * CRC-16/XMODEM (polynomial 0x1021, initial value 0), matching
+ * _crc_xmodem_update() from avr-libc's <util/crc16.h>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Fold a single byte into a running CRC.
+ * @param crc The CRC so far (0 to start a new one).
+ * @param data The byte to add.
+ * @return The updated CRC.
+ */
+uint16_t crc16_update(uint16_t crc, uint8_t data);
+
+/**
+ * @brief Fold a buffer into a running CRC.
+ * @param crc The CRC so far (0 to start a new one).
+ * @param data
+ * @param length
+ * @return The updated CRC.
+ */
+uint16_t crc16(uint16_t crc, const void* data, size_t length);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
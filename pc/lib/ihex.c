@@ -0,0 +1,336 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ */
+
+#include "ihex.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Record types. */
+#define IHEX_DATA           0x00
+#define IHEX_EOF            0x01
+#define IHEX_SEGMENT        0x02
+#define IHEX_START_SEGMENT  0x03
+#define IHEX_LINEAR         0x04
+#define IHEX_START_LINEAR   0x05
+
+/* Bytes in a record besides its data: length, address, type and checksum. */
+#define IHEX_OVERHEAD 5
+
+/* Data bytes each record type must have, or -1 for any number. */
+static const int recordLength[] = {
+  [IHEX_DATA] = -1,
+  [IHEX_EOF] = 0,
+  [IHEX_SEGMENT] = 2,
+  [IHEX_START_SEGMENT] = 4,
+  [IHEX_LINEAR] = 2,
+  [IHEX_START_LINEAR] = 4,
+};
+
+/*
+ * Value of every character as a hex digit.  Anything else is 0x100, so
+ * that a byte decoded from two characters comes out above 0xFF if either
+ * of them was bad, and one check covers a whole record.
+ */
+#define BAD 0x100
+static const uint16_t hexval[256] = {
+  [0 ... 255] = BAD,
+  ['0'] = 0x0, ['1'] = 0x1, ['2'] = 0x2, ['3'] = 0x3, ['4'] = 0x4,
+  ['5'] = 0x5, ['6'] = 0x6, ['7'] = 0x7, ['8'] = 0x8, ['9'] = 0x9,
+  ['A'] = 0xA, ['B'] = 0xB, ['C'] = 0xC, ['D'] = 0xD, ['E'] = 0xE, ['F'] = 0xF,
+  ['a'] = 0xA, ['b'] = 0xB, ['c'] = 0xC, ['d'] = 0xD, ['e'] = 0xE, ['f'] = 0xF,
+};
+
+static inline unsigned hexbyte(const char* p) {
+  return hexval[(uint8_t)p[0]] << 4 | hexval[(uint8_t)p[1]];
+}
+
+/* Where the parser is, for error messages, and how much it has allocated. */
+typedef struct {
+  IntelHexImage* image;
+  const char* name;
+  size_t line;
+  uint32_t capacity;    // bytes allocated from image->base
+} Parser;
+
+static int fail(const Parser* parser, const char* fmt, ...) {
+  va_list args;
+  fprintf(stderr, "%s:%zu: ", parser->name, parser->line);
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  return -1;
+}
+
+/**
+ * @brief Grow the image to cover "length" bytes at "address".
+ * @return 0 on success, -1 if the image would span too much memory.
+ */
+static int reserve(Parser* parser, uint32_t address, uint32_t length) {
+  IntelHexImage* image = parser->image;
+  uint64_t lo = address & ~(uint64_t)(image->pagesize - 1);
+  uint64_t hi = ((uint64_t)address + length + image->pagesize - 1) &
+    ~(uint64_t)(image->pagesize - 1);
+
+  if (0 == image->size) {
+    image->base = lo;
+  }
+  uint64_t base = lo < image->base ? lo : image->base;
+  uint64_t top = (uint64_t)image->base + image->size;
+  top = hi > top ? hi : top;
+  if (top - base > IHEX_MAX_SPAN) {
+    return fail(parser, "data at %08x makes the image span more than %u bytes",
+                address, IHEX_MAX_SPAN);
+  }
+
+  uint32_t shift = image->base - base;
+  if (shift || top - base > parser->capacity) {
+    /* Double the allocation, so that ascending records grow it rarely. */
+    uint64_t capacity = 2 * (uint64_t)parser->capacity;
+    capacity = capacity > top - base ? capacity : top - base;
+    capacity = capacity < IHEX_MAX_SPAN ? capacity : IHEX_MAX_SPAN;
+
+    uint8_t* data = malloc(capacity);
+    uint8_t* used = malloc(capacity);
+    if (NULL == data || NULL == used) {
+      free(data);
+      free(used);
+      return fail(parser, "out of memory for a %u byte image", (uint32_t)capacity);
+    }
+    memset(data, 0xFF, capacity);
+    memset(used, 0, capacity);
+    if (image->size) {
+      memcpy(data + shift, image->data, image->size);
+      memcpy(used + shift, image->used, image->size);
+    }
+
+    free(image->data);
+    free(image->used);
+    image->data = data;
+    image->used = used;
+    parser->capacity = capacity;
+  }
+
+  image->base = base;
+  image->size = top - base;
+  return 0;
+}
+
+/**
+ * @brief Copy a data record's bytes into the image.
+ */
+static int store(Parser* parser, uint32_t address, const uint8_t* data, uint32_t length) {
+  if (0 == length) {
+    return 0;
+  }
+  if (-1 == reserve(parser, address, length)) {
+    return -1;
+  }
+
+  IntelHexImage* image = parser->image;
+  memcpy(&image->data[address - image->base], data, length);
+  memset(&image->used[address - image->base], 1, length);
+  return 0;
+}
+
+int IntelHexImage_parse(IntelHexImage* image, const char* name, const char* text,
+                        size_t length, uint32_t pagesize) {
+  memset(image, 0, sizeof(*image));
+  image->pagesize = pagesize;
+  image->start = IHEX_NO_START;
+
+  Parser parser = { image, name, 1, 0 };
+  if (0 == pagesize || (pagesize & (pagesize - 1)) || pagesize > IHEX_MAX_SPAN) {
+    fail(&parser, "page size %u isn't a power of 2", pagesize);
+    return -1;
+  }
+
+  const char* p = text;
+  const char* end = text + length;
+  uint32_t segment = 0;     // added to each data record's address
+  int wrap = 1;             // segment addressing wraps offsets at 64 KB
+  int ended = 0;
+
+  while (p < end && !ended) {
+    /* Lines may end in CR, LF or CR LF. */
+    if ('\n' == *p) {
+      ++parser.line;
+      ++p;
+      continue;
+    }
+    if ('\r' == *p) {
+      if (p + 1 == end || '\n' != p[1]) {
+        ++parser.line;
+      }
+      ++p;
+      continue;
+    }
+
+    if (':' != *p) {
+      goto error_start;
+    }
+    if (end - p < 1 + 2 * IHEX_OVERHEAD) {
+      goto error_short;
+    }
+    unsigned count = hexbyte(p + 1);
+    if (count > 0xFF) {
+      goto error_digit;
+    }
+    size_t recordChars = 1 + 2 * (IHEX_OVERHEAD + count);
+    if ((size_t)(end - p) < recordChars) {
+      goto error_short;
+    }
+
+    uint8_t record[IHEX_OVERHEAD + 0xFF];
+    unsigned check = 0;
+    uint8_t sum = 0;
+    for (unsigned i = 0; i < IHEX_OVERHEAD + count; ++i) {
+      unsigned byte = hexbyte(p + 1 + 2 * i);
+      check |= byte;
+      record[i] = byte;
+      sum += byte;
+    }
+    if (check > 0xFF) {
+      goto error_digit;
+    }
+    if (sum) {
+      fail(&parser, "bad checksum %02x; the record sums to %02x",
+           record[IHEX_OVERHEAD - 1 + count], sum);
+      goto error;
+    }
+    p += recordChars;
+    if (p < end && '\r' != *p && '\n' != *p) {
+      fail(&parser, "unexpected '%c' after the record", *p);
+      goto error;
+    }
+
+    ++image->records;
+    uint16_t offset = record[1] << 8 | record[2];
+    uint8_t type = record[3];
+    const uint8_t* data = &record[4];
+
+    if (type > IHEX_START_LINEAR) {
+      fail(&parser, "unknown record type %02x", type);
+      goto error;
+    }
+    if (recordLength[type] >= 0 && count != (unsigned)recordLength[type]) {
+      fail(&parser, "type %02x record with %u data bytes", type, count);
+      goto error;
+    }
+
+    switch (type) {
+    case IHEX_DATA:
+      if (wrap && offset + count > 0x10000) {
+        /* The rest of the record continues from the segment's start. */
+        uint32_t first = 0x10000 - offset;
+        if (-1 == store(&parser, segment + offset, data, first) ||
+            -1 == store(&parser, segment, data + first, count - first)) {
+          goto error;
+        }
+      } else {
+        if ((uint64_t)segment + offset + count > 0x100000000ull) {
+          fail(&parser, "data runs past the end of 32-bit memory");
+          goto error;
+        }
+        if (-1 == store(&parser, segment + offset, data, count)) {
+          goto error;
+        }
+      }
+      break;
+    case IHEX_EOF:
+      ended = 1;
+      break;
+    case IHEX_SEGMENT:
+    case IHEX_LINEAR:
+      wrap = IHEX_SEGMENT == type;
+      segment = (uint32_t)(data[0] << 8 | data[1]) << (wrap ? 4 : 16);
+      break;
+    case IHEX_START_SEGMENT:
+      image->start = ((uint32_t)(data[0] << 8 | data[1]) << 4) + (data[2] << 8 | data[3]);
+      break;
+    case IHEX_START_LINEAR:
+      image->start = (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+      break;
+    }
+  }
+
+  if (!ended) {
+    fail(&parser, "no end-of-file record");
+    goto error;
+  }
+  return 0;
+
+error_start:
+  fail(&parser, "expected ':' to start a record, got '%c'", *p);
+  goto error;
+error_short:
+  fail(&parser, "record cut short by the end of the file");
+  goto error;
+error_digit:
+  fail(&parser, "invalid hex digit");
+error:
+  IntelHexImage_free(image);
+  return -1;
+}
+
+int IntelHexImage_load(IntelHexImage* image, const char* path, uint32_t pagesize) {
+  int fd = open(path, O_RDONLY);
+  if (-1 == fd) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (-1 == fstat(fd, &st)) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  /* mmap(2) refuses empty files; an empty file just lacks an end record. */
+  const char* text = "";
+  if (st.st_size > 0) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == text) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    madvise((void*)text, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  int result = IntelHexImage_parse(image, path, text, st.st_size, pagesize);
+
+  if (st.st_size > 0) {
+    munmap((void*)text, st.st_size);
+  }
+  return result;
+}
+
+void IntelHexImage_free(IntelHexImage* image) {
+  free(image->data);
+  free(image->used);
+  image->data = NULL;
+  image->used = NULL;
+  image->size = 0;
+}
+
+int IntelHexImage_pageUsed(const IntelHexImage* image, uint32_t address) {
+  return NULL != memchr(&image->used[address - image->base], 1, image->pagesize);
+}
@@ -0,0 +1,82 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ *
+ * Reads Intel HEX files into a flat memory image.
+ * https://en.wikipedia.org/wiki/Intel_HEX
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* IntelHexImage.start when the file gives no start address. */
+#define IHEX_NO_START 0xFFFFFFFFu
+
+/* Most bytes an image may span, from its lowest address to its highest. */
+#define IHEX_MAX_SPAN (16u << 20)
+
+/*
+ * A program assembled from the data records of a .hex file.  The image
+ * covers whole pages from the lowest address any record writes to the
+ * highest; bytes no record writes are 0xFF, the value of erased flash.
+ */
+typedef struct IntelHexImage {
+  uint8_t* data;        // image bytes, data[0] being at "base"
+  uint8_t* used;        // 1 for each byte a record wrote, else 0
+  uint32_t base;        // a multiple of "pagesize"
+  uint32_t size;        // bytes in "data", a multiple of "pagesize"
+  uint32_t pagesize;
+  uint32_t start;       // from a type 03 or 05 record, or IHEX_NO_START
+  size_t records;       // records read, including the end-of-file record
+} IntelHexImage;
+
+/**
+ * @brief Assemble the .hex file at "path" into "image".  Records are
+ * checksummed, lines may end in CR, LF or both, and digits may be either
+ * case.  Extended segment (02) and linear (04) address records place data
+ * anywhere in 32-bit memory.
+ * @param image Filled in on success; free it with IntelHexImage_free().
+ * @param path
+ * @param pagesize Power of 2 to align the image to; 1 for none.
+ * @return 0 on success.  On failure, -1 after printing the file, line and
+ * reason to stderr.
+ */
+int IntelHexImage_load(IntelHexImage* image, const char* path, uint32_t pagesize);
+
+/**
+ * @brief Like IntelHexImage_load(), for .hex text already in memory.
+ * @param image
+ * @param name Names the text in error messages.
+ * @param text
+ * @param length
+ * @param pagesize
+ * @return 0 on success, -1 on failure.
+ */
+int IntelHexImage_parse(IntelHexImage* image, const char* name, const char* text,
+                        size_t length, uint32_t pagesize);
+
+/**
+ * @brief Release the memory held by an image.
+ */
+void IntelHexImage_free(IntelHexImage* image);
+
+/**
+ * @brief Whether any record wrote to the page starting at "address".
+ * @param image
+ * @param address A multiple of the image's page size, within the image.
+ */
+int IntelHexImage_pageUsed(const IntelHexImage* image, uint32_t address);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -14,6 +14,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 
 off_t filesize(int fd) {
   off_t curr = lseek(fd, 0, SEEK_CUR);
@@ -28,6 +29,18 @@ off_t filesize(int fd) {
   return filelen;
 }
 
+int64_t monotonic_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int64_t monotonic_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 void pabort(const char *fmt, ...) {
   int eno = errno;
   char buffer[PABORT_CHAR_BUFFER_LEN];
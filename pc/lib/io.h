@@ -11,6 +11,7 @@
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -23,6 +24,16 @@ extern "C" {
  */
 off_t filesize(int fd);
 
+/**
+ * @brief Milliseconds on a clock that never jumps, for timeouts.
+ */
+int64_t monotonic_ms(void);
+
+/**
+ * @brief Microseconds on the same clock as monotonic_ms(), for measuring.
+ */
+int64_t monotonic_us(void);
+
 #define PABORT_CHAR_BUFFER_LEN 1024
 
 /**
@@ -14,8 +14,15 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include <linux/joystick.h>
+#include <linux/input.h>
 
 #include <json/json_tokener.h>
 #include <json/json_object.h>
@@ -35,6 +42,42 @@ int jsonParseInt(json_object* obj, const char* key) {
   return v;
 }
 
+int jsonOptInt(json_object* obj, const char* key, int fallback) {
+  json_object* o;
+  return json_object_object_get_ex(obj, key, &o) ? json_object_get_int(o) : fallback;
+}
+
+double jsonOptDouble(json_object* obj, const char* key, double fallback) {
+  json_object* o;
+  return json_object_object_get_ex(obj, key, &o) ? json_object_get_double(o) : fallback;
+}
+
+int jsonOptBool(json_object* obj, const char* key, int fallback) {
+  json_object* o;
+  return json_object_object_get_ex(obj, key, &o) ? json_object_get_boolean(o) : fallback;
+}
+
+/**
+ * @brief Read one "channels" entry into "map".
+ */
+static ChannelMap parseChannel(json_object* entry) {
+  ChannelMap map = ChannelMap_init(jsonParseInt(entry, "axis"), jsonParseInt(entry, "channel"));
+  map.invert = jsonOptBool(entry, "invert", map.invert);
+  map.expo = jsonOptDouble(entry, "expo", map.expo);
+  map.trim = jsonOptInt(entry, "trim", map.trim);
+
+  int min = jsonOptInt(entry, "min", map.min);
+  int max = jsonOptInt(entry, "max", map.max);
+  if (min < 0 || max > UINT16_MAX) {
+    fprintf(stderr, "axis %d: limits must be within [0,%d] ticks\n", map.axis, UINT16_MAX);
+    abort();
+  }
+  map.min = min;
+  map.max = max;
+
+  return map;
+}
+
 JoystickOptions JoystickOptions_init(const char* devicePath, const char* optionsPath) {
   int fd = open(optionsPath, O_RDONLY);
   if (-1 == fd) {
@@ -42,12 +85,13 @@ JoystickOptions JoystickOptions_init(const char* devicePath, const char* options
   }
 
   size_t filelen = filesize(fd);
-  char* data = malloc(filelen);
+  char* data = malloc(filelen + 1);
   assert(data);
   if (-1 == read(fd, data, filelen)) {
     pabort("reading file");
   }
   assert(-1 != close(fd));
+  data[filelen] = '\0';
 
   json_tokener* tok = json_tokener_new();
   json_object* obj = json_tokener_parse(data);
@@ -60,27 +104,345 @@ JoystickOptions JoystickOptions_init(const char* devicePath, const char* options
   free(data);
 
   JoystickOptions opts;
-  if (!strncpy(opts.devicepath, devicePath, strlen(devicePath))) {
-    perror("copying device path");
-    abort();
+  size_t len = strlen(devicePath) < PATH_MAX ? strlen(devicePath) : PATH_MAX - 1;
+  memcpy(opts.devicepath, devicePath, len);
+  opts.devicepath[len] = '\0';
+  opts.fastReplay = 0;
+
+  json_object* channels;
+  if (json_object_object_get_ex(obj, "channels", &channels)) {
+    opts.nchannels = json_object_array_length(channels);
+    if (opts.nchannels > JOYSTICK_MAX_CHANNELS) {
+      fprintf(stderr, "%d channels given; at most %d are supported\n",
+              opts.nchannels, JOYSTICK_MAX_CHANNELS);
+      abort();
+    }
+    for (int i = 0; i < opts.nchannels; ++i) {
+      opts.channels[i] = parseChannel(json_object_array_get_idx(channels, i));
+    }
+  } else {
+    /* Pushing a stick forward reads negative, but should raise the servo. */
+    opts.nchannels = 2;
+    opts.channels[0] = ChannelMap_init(jsonParseInt(obj, "y_left"), 0);
+    opts.channels[1] = ChannelMap_init(jsonParseInt(obj, "y_right"), 1);
+    opts.channels[0].invert = opts.channels[1].invert = 1;
   }
+  json_object_put(obj);
 
-  opts.y_left = jsonParseInt(obj, "y_left");
-  opts.y_right = jsonParseInt(obj, "y_right");
-  free(obj);
+  for (int i = 0; i < opts.nchannels; ++i) {
+    ChannelMap* map = &opts.channels[i];
+    if (map->axis < 0 || map->axis >= JOYSTICK_MAX_AXES ||
+        map->channel < 0 || map->channel >= JOYSTICK_MAX_CHANNELS) {
+      fprintf(stderr, "axis %d, channel %d: out of range\n", map->axis, map->channel);
+      abort();
+    }
+    for (int j = 0; j < i; ++j) {
+      if (opts.channels[j].channel == map->channel) {
+        fprintf(stderr, "channel %d is mapped more than once\n", map->channel);
+        abort();
+      }
+    }
+    ChannelMap_compile(map);
+  }
 
   return opts;
 }
 
+/* Joystick and input events taken per read(2). */
+#define EVENT_BATCH 64
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define NLONGS(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/*
+ * What an evdev device needs on top of a Joystick: how its codes number as
+ * joydev axes and buttons, and the report being put together until the
+ * next SYN_REPORT.
+ */
+typedef struct JoystickEvdev {
+  int16_t axisOf[ABS_CNT];      // axis number for each ABS code, or -1
+  int16_t buttonOf[KEY_CNT];    // button number for each key code, or -1
+  struct input_absinfo absinfo[JOYSTICK_MAX_AXES];
+  JoystickState report;         // state with every change read so far applied
+  int fresh;                    // report holds the state read at open, not yet delivered
+  int dropped;                  // the kernel dropped events; resync at the next SYN_REPORT
+  struct input_event events[EVENT_BATCH];
+  int next;
+  int count;
+} JoystickEvdev;
+
+static int testBit(const unsigned long* bits, int bit) {
+  return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+/**
+ * @brief Scale an evdev axis reading to the [-32767, 32767] joydev uses.
+ */
+static int16_t evdevScale(const struct input_absinfo* info, int value) {
+  if (info->maximum <= info->minimum) {
+    return 0;
+  }
+  if (value < info->minimum) {
+    value = info->minimum;
+  } else if (value > info->maximum) {
+    value = info->maximum;
+  }
+
+  int64_t span = (int64_t)info->maximum - info->minimum;
+  return ((int64_t)value - info->minimum) * 65534 / span - 32767;
+}
+
+/**
+ * @brief Read every axis and button straight from the device into the
+ * report, for when there are no events to build it from.
+ * @return 0 on success, -1 on error.
+ */
+static int evdevSync(const Joystick* js) {
+  JoystickEvdev* ev = js->evdev;
+
+  for (int code = 0; code < ABS_CNT; ++code) {
+    int axis = ev->axisOf[code];
+    if (axis < 0) {
+      continue;
+    }
+    if (-1 == ioctl(js->fd, EVIOCGABS(code), &ev->absinfo[axis])) {
+      return -1;
+    }
+    ev->report.axes[axis] = evdevScale(&ev->absinfo[axis], ev->absinfo[axis].value);
+  }
+
+  unsigned long keys[NLONGS(KEY_CNT)];
+  memset(keys, 0, sizeof(keys));
+  if (-1 == ioctl(js->fd, EVIOCGKEY(sizeof(keys)), keys)) {
+    return -1;
+  }
+  for (int code = 0; code < KEY_CNT; ++code) {
+    if (ev->buttonOf[code] >= 0) {
+      ev->report.buttons[ev->buttonOf[code]] = testBit(keys, code);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Set up "js" as an evdev device, numbering its axes and buttons in
+ * the same order joydev does.
+ */
+static void evdevOpen(Joystick* js) {
+  JoystickEvdev* ev = calloc(1, sizeof(JoystickEvdev));
+  assert(ev);
+  js->evdev = ev;
+
+  if (-1 == ioctl(js->fd, EVIOCGNAME(sizeof(js->name)), js->name)) {
+    pabort("Error getting joystick name");
+  }
+
+  unsigned long absBits[NLONGS(ABS_CNT)];
+  unsigned long keyBits[NLONGS(KEY_CNT)];
+  memset(absBits, 0, sizeof(absBits));
+  memset(keyBits, 0, sizeof(keyBits));
+  if (-1 == ioctl(js->fd, EVIOCGBIT(EV_ABS, sizeof(absBits)), absBits) ||
+      -1 == ioctl(js->fd, EVIOCGBIT(EV_KEY, sizeof(keyBits)), keyBits)) {
+    pabort("Error getting joystick capabilities");
+  }
+
+  memset(ev->axisOf, -1, sizeof(ev->axisOf));
+  memset(ev->buttonOf, -1, sizeof(ev->buttonOf));
+
+  js->naxes = 0;
+  for (int code = 0; code < ABS_CNT && js->naxes < JOYSTICK_MAX_AXES; ++code) {
+    if (testBit(absBits, code)) {
+      ev->axisOf[code] = js->naxes++;
+    }
+  }
+
+  /* Joydev numbers the joystick buttons first, then the miscellaneous ones. */
+  js->nbuttons = 0;
+  for (int code = BTN_JOYSTICK; code < KEY_CNT && js->nbuttons < JOYSTICK_MAX_BUTTONS; ++code) {
+    if (testBit(keyBits, code)) {
+      ev->buttonOf[code] = js->nbuttons++;
+    }
+  }
+  for (int code = BTN_MISC; code < BTN_JOYSTICK && js->nbuttons < JOYSTICK_MAX_BUTTONS; ++code) {
+    if (testBit(keyBits, code)) {
+      ev->buttonOf[code] = js->nbuttons++;
+    }
+  }
+
+  if (-1 == evdevSync(js)) {
+    pabort("Error getting joystick state");
+  }
+  ev->fresh = 1;
+}
+
+/*
+ * Playback of a memory-mapped recording.  Joystick.fd stands in for the
+ * device: a timerfd that fires when the next event is due, or in fast mode
+ * an eventfd that is always readable.
+ */
+typedef struct JoystickReplay {
+  const JoystickEvent* events;
+  size_t count;
+  size_t next;
+  int fast;
+  int64_t start;        // monotonic ms the first event is replayed at
+  uint32_t firstTime;   // timestamp of the first event
+} JoystickReplay;
+
+/**
+ * @brief Arm the replay timer for the next event, or at once when there are
+ * none left, so the reader comes back to see ENODATA.
+ */
+static int replayArm(const Joystick* js) {
+  const JoystickReplay* replay = js->replay;
+
+  int64_t due = replay->start;
+  if (replay->next < replay->count) {
+    due += (uint32_t)(replay->events[replay->next].time - replay->firstTime);
+  }
+
+  struct itimerspec when = {
+    .it_value = { due / 1000, (due % 1000) * 1000000L },
+  };
+  return timerfd_settime(js->fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+_Static_assert(0 == sizeof(JoystickRecordHeader) % sizeof(uint32_t),
+               "recorded events must stay aligned in the mapping");
+
+static void replayOpen(Joystick* js, const JoystickOptions* opts, size_t size) {
+  if (size < sizeof(JoystickRecordHeader)) {
+    fprintf(stderr, "%s is not a joystick recording\n", opts->devicepath);
+    abort();
+  }
+
+  const uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, js->fd, 0);
+  if (MAP_FAILED == data) {
+    pabort("mapping %s", opts->devicepath);
+  }
+  madvise((void*)data, size, MADV_SEQUENTIAL);
+  assert(-1 != close(js->fd));
+
+  const JoystickRecordHeader* header = (const JoystickRecordHeader*)data;
+  if (memcmp(header->magic, JOYSTICK_RECORD_MAGIC, sizeof(header->magic)) ||
+      sizeof(JoystickEvent) != header->eventSize) {
+    fprintf(stderr, "%s is not a joystick recording\n", opts->devicepath);
+    abort();
+  }
+
+  JoystickReplay* replay = calloc(1, sizeof(JoystickReplay));
+  assert(replay);
+  replay->events = (const JoystickEvent*)(data + sizeof(JoystickRecordHeader));
+  replay->count = (size - sizeof(JoystickRecordHeader)) / sizeof(JoystickEvent);
+  replay->fast = opts->fastReplay;
+  replay->start = monotonic_ms();
+  replay->firstTime = replay->count ? replay->events[0].time : 0;
+  js->replay = replay;
+
+  memcpy(js->name, header->name, sizeof(js->name));
+  js->name[sizeof(js->name) - 1] = '\0';
+  js->naxes = header->naxes;
+  js->nbuttons = header->nbuttons;
+  js->driverVersion = 0;
+
+  if (replay->fast) {
+    js->fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+  } else {
+    js->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  }
+  if (-1 == js->fd) {
+    pabort("creating replay timer");
+  }
+  if (!replay->fast && -1 == replayArm(js)) {
+    pabort("arming replay timer");
+  }
+}
+
+/**
+ * @brief Joystick_getEvents for a recording.
+ */
+static int replayGetEvents(const Joystick* js, JoystickEvent* events, int max) {
+  JoystickReplay* replay = js->replay;
+
+  if (replay->next == replay->count) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  size_t available = replay->count - replay->next;
+  if (replay->fast) {
+    /* One instant at a time, as the device would have delivered it. */
+    uint32_t time = replay->events[replay->next].time;
+    available = 1;
+    while (replay->next + available < replay->count && (int)available < max &&
+           replay->events[replay->next + available].time == time) {
+      ++available;
+    }
+  } else {
+    uint64_t expirations;
+    if (-1 == read(js->fd, &expirations, sizeof(expirations)) && EAGAIN != errno) {
+      return -1;
+    }
+
+    /* Only what is due by now. */
+    uint32_t elapsed = monotonic_ms() - replay->start;
+    available = 0;
+    while (replay->next + available < replay->count && (int)available < max &&
+           (uint32_t)(replay->events[replay->next + available].time - replay->firstTime) <= elapsed) {
+      ++available;
+    }
+  }
+
+  int count = available < (size_t)max ? (int)available : max;
+  memcpy(events, &replay->events[replay->next], count * sizeof(JoystickEvent));
+  replay->next += count;
+
+  if (!replay->fast && -1 == replayArm(js)) {
+    return -1;
+  }
+  return count;
+}
+
+int Joystick_isFastReplay(const Joystick* js) {
+  return js->replay && js->replay->fast;
+}
+
+int Joystick_writeRecordHeader(const Joystick* js, int fd) {
+  JoystickRecordHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, JOYSTICK_RECORD_MAGIC, sizeof(header.magic));
+  header.naxes = js->naxes;
+  header.nbuttons = js->nbuttons;
+  header.eventSize = sizeof(JoystickEvent);
+  memcpy(header.name, js->name, sizeof(header.name));
+
+  return sizeof(header) == write(fd, &header, sizeof(header)) ? 0 : -1;
+}
+
 Joystick Joystick_open(const JoystickOptions* opts) {
-  Joystick js;
+  Joystick js = { .evdev = NULL, .replay = NULL };
   js.fd = open(opts->devicepath, O_RDONLY | O_NONBLOCK);
   if (-1 == js.fd) {
     pabort("can't open device");
   }
 
+  struct stat st;
+  if (-1 == fstat(js.fd, &st)) {
+    pabort("can't stat device");
+  }
+  if (S_ISREG(st.st_mode)) {
+    replayOpen(&js, opts, st.st_size);
+    return js;
+  }
+
   if (-1 == ioctl(js.fd, JSIOCGVERSION, &js.driverVersion)) {
-    pabort("Error getting driver version");
+    /* Not joydev, so try it as evdev. */
+    if (-1 == ioctl(js.fd, EVIOCGVERSION, &js.driverVersion)) {
+      pabort("Error getting driver version");
+    }
+    evdevOpen(&js);
+    return js;
   }
 
   if (-1 == ioctl(js.fd, JSIOCGNAME(sizeof(js.name)), js.name)) {
@@ -98,18 +460,163 @@ Joystick Joystick_open(const JoystickOptions* opts) {
   return js;
 }
 
+_Static_assert(sizeof(JoystickEvent) == sizeof(struct js_event), "JoystickEvent must match js_event");
+_Static_assert(offsetof(JoystickEvent, time) == offsetof(struct js_event, time), "time");
+_Static_assert(offsetof(JoystickEvent, value) == offsetof(struct js_event, value), "value");
+_Static_assert(offsetof(JoystickEvent, type) == offsetof(struct js_event, type), "type");
+_Static_assert(offsetof(JoystickEvent, number) == offsetof(struct js_event, number), "number");
+
+/**
+ * @brief Take the next input event from an evdev device, reading another
+ * batch when the last one is used up.
+ * @return 1 if "event" was filled in, 0 if there are none, -1 on error.
+ */
+static int evdevNext(const Joystick* js, struct input_event* event) {
+  JoystickEvdev* ev = js->evdev;
+
+  if (ev->next == ev->count) {
+    ssize_t got;
+    do {
+      got = read(js->fd, ev->events, sizeof(ev->events));
+    } while (-1 == got && EINTR == errno);
+
+    if (-1 == got) {
+      return EAGAIN == errno ? 0 : -1;
+    }
+    ev->next = 0;
+    ev->count = got / sizeof(struct input_event);
+    if (0 == ev->count) {
+      return 0;
+    }
+  }
+
+  *event = ev->events[ev->next++];
+  return 1;
+}
+
+static uint32_t evdevTime(const struct input_event* event) {
+  return (uint64_t)event->input_event_sec * 1000 + event->input_event_usec / 1000;
+}
+
+/**
+ * @brief Translate "event" to its joydev equivalent.
+ * @return 1 if it has one, 0 if joydev would not report it.
+ */
+static int evdevTranslate(const JoystickEvdev* ev, const struct input_event* event,
+                          JoystickEvent* out) {
+  out->time = evdevTime(event);
+
+  if (EV_ABS == event->type && event->code < ABS_CNT && ev->axisOf[event->code] >= 0) {
+    out->type = JSE_AXIS;
+    out->number = ev->axisOf[event->code];
+    out->value = evdevScale(&ev->absinfo[out->number], event->value);
+    return 1;
+  }
+
+  if (EV_KEY == event->type && event->code < KEY_CNT && ev->buttonOf[event->code] >= 0) {
+    out->type = JSE_BUTTON;
+    out->number = ev->buttonOf[event->code];
+    out->value = 0 != event->value;  // 2 is autorepeat, still pressed
+    return 1;
+  }
+
+  return 0;
+}
+
 int Joystick_getEvent(const Joystick* js, JoystickEvent* event) {
+  return Joystick_getEvents(js, event, 1);
+}
+
+int Joystick_getEvents(const Joystick* js, JoystickEvent* events, int max) {
+  if (js->replay) {
+    return replayGetEvents(js, events, max);
+  }
+
+  if (js->evdev) {
+    struct input_event event;
+    int count = 0;
+    int got = 0;
+
+    while (count < max && 1 == (got = evdevNext(js, &event))) {
+      count += evdevTranslate(js->evdev, &event, &events[count]);
+    }
+    return count > 0 ? count : got;
+  }
+
   while (1) {
-    struct js_event jsevent;
+    ssize_t got = read(js->fd, events, max * sizeof(JoystickEvent));
+    if (-1 != got) {
+      /* The driver only ever hands out whole events. */
+      return got / sizeof(JoystickEvent);
+    }
+    if (EINTR != errno) {
+      return EAGAIN == errno ? 0 : -1;
+    }
+  }
+}
+
+/**
+ * @brief Apply a translated event to "state".
+ */
+static void applyEvent(JoystickState* state, const JoystickEvent* event) {
+  switch (event->type & ~JSE_INIT) {
+  case JSE_AXIS:
+    if (event->number < JOYSTICK_MAX_AXES) {
+      state->axes[event->number] = event->value;
+    }
+    break;
+  case JSE_BUTTON:
+    if (event->number < JOYSTICK_MAX_BUTTONS) {
+      state->buttons[event->number] = event->value;
+    }
+    break;
+  }
+  state->time = event->time;
+}
+
+int Joystick_readState(const Joystick* js, JoystickState* state) {
+  if (!js->evdev) {
+    JoystickEvent events[EVENT_BATCH];
+    int got = Joystick_getEvents(js, events, EVENT_BATCH);
+    for (int i = 0; i < got; ++i) {
+      applyEvent(state, &events[i]);
+    }
+    return got > 0 ? 1 : got;
+  }
+
+  JoystickEvdev* ev = js->evdev;
+  if (ev->fresh) {
+    ev->fresh = 0;
+    *state = ev->report;
+    return 1;
+  }
 
-    if (read(js->fd, &jsevent, sizeof(struct js_event)) == sizeof(struct js_event)) {
-      event->number = jsevent.number;
-      event->time = jsevent.time;
-      event->type = jsevent.type;
-      event->value = jsevent.value;
-      return 1;
+  struct input_event event;
+  int got;
+  while (1 == (got = evdevNext(js, &event))) {
+    if (EV_SYN == event.type) {
+      if (SYN_DROPPED == event.code) {
+        /* Whatever we have is incomplete; ignore it until the next report. */
+        ev->dropped = 1;
+      } else if (SYN_REPORT == event.code) {
+        if (ev->dropped) {
+          ev->dropped = 0;
+          if (-1 == evdevSync(js)) {
+            return -1;
+          }
+        }
+        ev->report.time = evdevTime(&event);
+        *state = ev->report;
+        return 1;
+      }
+      continue;
     }
 
-    return EAGAIN == errno ? 0 : -1;
+    JoystickEvent translated;
+    if (!ev->dropped && evdevTranslate(ev, &event, &translated)) {
+      applyEvent(&ev->report, &translated);
+    }
   }
+
+  return got;
 }
@@ -15,24 +15,49 @@
 #include <stdint.h>
 #include <linux/limits.h>
 
+#include "channelmap.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Most axis-to-channel mappings a configuration may list. */
+#define JOYSTICK_MAX_CHANNELS 16
+
 typedef struct JoystickOptions {
   char devicepath[PATH_MAX];
-  char y_left;    // y-axis on left joystick
-  char y_right;   // y-axis on right joystick
+  int fastReplay;       // replay a recording as fast as it is read, not in real time
+  int nchannels;
+  ChannelMap channels[JOYSTICK_MAX_CHANNELS];  // compiled, one per servo channel
 } JoystickOptions;
 
+/* Most axes and buttons a JoystickState tracks. */
+#define JOYSTICK_MAX_AXES 64
+#define JOYSTICK_MAX_BUTTONS 128
+
+struct JoystickEvdev;
+struct JoystickReplay;
+
 typedef struct Joystick {
   int fd;
   int driverVersion;
   char name[128];
-  char naxes;
-  char nbuttons;
+  uint8_t naxes;
+  uint8_t nbuttons;
+  struct JoystickEvdev* evdev;  // NULL for a /dev/input/js* device
+  struct JoystickReplay* replay;  // non-NULL when playing back a recording
 } Joystick;
 
+/*
+ * Every axis and button of a joystick at one instant.  Axes are scaled to
+ * [-32767, 32767] whichever interface they come from.
+ */
+typedef struct JoystickState {
+  uint32_t time;        /* timestamp of the latest change in milliseconds */
+  int16_t axes[JOYSTICK_MAX_AXES];
+  uint8_t buttons[JOYSTICK_MAX_BUTTONS];
+} JoystickState;
+
 /*
  * The kinds of {@see JoystickEvent} events that can occur.
  */
@@ -42,7 +67,8 @@ typedef struct Joystick {
 
 /*
  * Modeled after Linux's jsevent, this contains information
- * about a joystick event.
+ * about a joystick event.  It has the same layout, so events are read
+ * straight into it.
  */
 typedef struct JoystickEvent {
   uint32_t time;        /* event timestamp in milliseconds */
@@ -51,21 +77,59 @@ typedef struct JoystickEvent {
   unsigned char number; /* axis/button number */
 } JoystickEvent;
 
+/*
+ * A recording of a joystick, as written by jstest --record: this header,
+ * then JoystickEvents back to back in host byte order, exactly as read.
+ */
+#define JOYSTICK_RECORD_MAGIC "JSR1"
+
+typedef struct JoystickRecordHeader {
+  char magic[4];        // JOYSTICK_RECORD_MAGIC, without the terminator
+  uint8_t naxes;
+  uint8_t nbuttons;
+  uint16_t eventSize;   // sizeof(JoystickEvent)
+  char name[128];
+} JoystickRecordHeader;
+
 /**
  * @brief Create and return a set of joystick options.
+ *
+ * The options file is a JSON object holding a "channels" array, each entry
+ * of which maps an "axis" to a servo "channel", optionally with "invert",
+ * "expo", "trim", "min" and "max" (see {@see ChannelMap}).  Older files
+ * that only give "y_left" and "y_right" axes map them, inverted, to
+ * channels 0 and 1.
+ *
  * @param devicePath
  * @param optionsPath
- * @return Options for the joystick.
+ * @return Options for the joystick, with every channel's table compiled.
  */
 JoystickOptions JoystickOptions_init(const char* devicePath, const char* optionsPath);
 
 /**
  * @brief Open a joystick device using the given "opts".
+ *
+ * Both the joydev (/dev/input/js*) and evdev (/dev/input/event*)
+ * interfaces are supported.  Evdev axes and buttons are numbered the way
+ * joydev would number them, so a mapping works with either.
+ *
+ * A regular file is taken to be a recording, which is memory-mapped and
+ * played back through the same calls, paced by its timestamps unless
+ * opts->fastReplay is set.  A fast replay is always ready, and each read
+ * returns only the events of one timestamp, so the reports come out as
+ * they were recorded, just sooner.  Once it has all been read, the read
+ * calls fail with errno set to ENODATA.
+ *
  * @param opts
  * @return Information about the opened joystick.
  */
 Joystick Joystick_open(const JoystickOptions* opts);
 
+/**
+ * @return Non-zero if "js" is a recording replayed with opts->fastReplay.
+ */
+int Joystick_isFastReplay(const Joystick* js);
+
 /**
  * @brief Gets an event from the joystick defined in "js".
  * @param js The joystick device handle.
@@ -74,6 +138,74 @@ Joystick Joystick_open(const JoystickOptions* opts);
  */
 int Joystick_getEvent(const Joystick* js, JoystickEvent* event);
 
+/**
+ * @brief Gets as many as "max" events from the joystick defined in "js",
+ * with a single read(2).
+ * @param js The joystick device handle.
+ * @param events Where to store the events.
+ * @param max How many "events" has room for.
+ * @return How many events were stored, 0 if there were none, and -1 on
+ * error.  Fewer than "max" means there are no more for now.
+ */
+int Joystick_getEvents(const Joystick* js, JoystickEvent* events, int max);
+
+/**
+ * @brief Write the header of a recording of "js" to "fd".  The events that
+ * follow are written as they are got from Joystick_getEvents.
+ * @return 0 on success, -1 on error.
+ */
+int Joystick_writeRecordHeader(const Joystick* js, int fd);
+
+/**
+ * @brief Bring "state" up to date with the next complete report from "js".
+ *
+ * An evdev device groups the changes of one report, such as a stick moving
+ * on both axes, between SYN_REPORT markers, and they are applied together.
+ * Joydev has no such markers, so everything it has pending is applied as
+ * one report.  Use either this or Joystick_getEvents on a device, not both.
+ *
+ * @param js The joystick device handle.
+ * @param state The state to update; zero it before the first call.
+ * @return 1 if a report was applied, 0 if none is complete yet, and -1 on
+ * error.
+ */
+int Joystick_readState(const Joystick* js, JoystickState* state);
+
+/*
+ * A thread that keeps reading a joystick and publishing its latest state,
+ * so another thread can take a consistent copy whenever it likes without
+ * locking, however busy either side is.
+ */
+typedef struct JoystickReader JoystickReader;
+
+/**
+ * @brief Start a thread reading reports from "js".  A fast replay is read
+ * in step with JoystickReader_snapshot instead, one report per snapshot,
+ * since reading ahead would skip most of the recording.
+ * @param js The joystick; the reader owns it until it is stopped.
+ * @return The reader, or NULL on error.
+ */
+JoystickReader* JoystickReader_start(const Joystick* js);
+
+/**
+ * @brief A descriptor that becomes readable when a new state is published
+ * or the reader fails, for use with poll(2) or epoll(7).  Reading it is
+ * up to the caller and only clears the readiness.
+ */
+int JoystickReader_fd(const JoystickReader* reader);
+
+/**
+ * @brief Copy the latest published state into "state".
+ * @return 1 if it changed since the previous call, 0 if not, and -1 if
+ * the reader thread has stopped on an error, with errno set to its cause.
+ */
+int JoystickReader_snapshot(JoystickReader* reader, JoystickState* state);
+
+/**
+ * @brief Stop the reader thread and free it.
+ */
+void JoystickReader_stop(JoystickReader* reader);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,227 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ */
+
+#include "joystick.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+/* Set in "middle" while the buffer it names hasn't been taken by the reader. */
+#define FRESH 4u
+#define INDEX 3u
+
+/*
+ * A triple buffer: the input thread fills "back", the control thread copies
+ * from "front", and "middle" passes buffers between them.  Each side swaps
+ * its own buffer with the middle one in a single atomic exchange, so neither
+ * ever waits for the other or sees a half-written state.
+ */
+struct JoystickReader {
+  Joystick js;
+  JoystickState buffers[3];
+  atomic_uint middle;
+  unsigned back;          // owned by the input thread
+  unsigned front;         // owned by the control thread
+  atomic_int error;       // errno that stopped the input thread, or 0
+  int eventfd;            // signals the control thread
+  int stopfd;             // signals the input thread
+  int lockstep;           // publish one report at a time (a fast replay)
+  int takenfd;            // signals the input thread that a report was taken
+  pthread_t thread;
+};
+
+static void notify(int fd) {
+  uint64_t one = 1;
+  /* A full counter still leaves the fd readable, which is all that matters. */
+  while (-1 == write(fd, &one, sizeof(one)) && EINTR == errno) {
+  }
+}
+
+/**
+ * @brief In lockstep, wait until the control thread has taken the state
+ * published last.
+ * @return 1 once it has, 0 if the thread was asked to stop, and -1 on error.
+ */
+static int wait_taken(JoystickReader* reader) {
+  struct pollfd fds[] = {
+    { reader->takenfd, POLLIN, 0 },
+    { reader->stopfd, POLLIN, 0 },
+  };
+
+  while (atomic_load_explicit(&reader->middle, memory_order_acquire) & FRESH) {
+    if (-1 == poll(fds, 2, -1)) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return -1;
+    }
+    if (fds[1].revents) {
+      return 0;
+    }
+
+    uint64_t count;
+    if (-1 == read(reader->takenfd, &count, sizeof(count)) && EAGAIN != errno) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+static void* run(void* arg) {
+  JoystickReader* reader = arg;
+  JoystickState state = { 0 };
+
+  struct pollfd fds[] = {
+    { reader->js.fd, POLLIN, 0 },
+    { reader->stopfd, POLLIN, 0 },
+  };
+
+  /* Taken where the failure happens, before anything else can touch errno. */
+  int error;
+
+  while (1) {
+    if (-1 == poll(fds, 2, -1)) {
+      if (EINTR == errno) {
+        continue;
+      }
+      error = errno;
+      break;
+    }
+    if (fds[1].revents) {
+      return NULL;
+    }
+
+    int published = 0;
+    int got;
+    while (1) {
+      /* Not every failure sets errno, so don't let an old value stand in. */
+      errno = 0;
+      got = Joystick_readState(&reader->js, &state);
+      if (1 != got) {
+        break;
+      }
+      reader->buffers[reader->back] = state;
+      unsigned old = atomic_exchange_explicit(&reader->middle, reader->back | FRESH,
+                                              memory_order_acq_rel);
+      reader->back = old & INDEX;
+      published = 1;
+
+      if (reader->lockstep) {
+        notify(reader->eventfd);
+        published = 0;
+
+        int taken = wait_taken(reader);
+        if (0 == taken) {
+          return NULL;
+        }
+        if (-1 == taken) {
+          got = -1;
+          break;
+        }
+      }
+    }
+
+    if (-1 == got) {
+      error = errno ? errno : EIO;
+      break;
+    }
+    if (published) {
+      notify(reader->eventfd);
+    }
+  }
+
+  atomic_store(&reader->error, error);
+  notify(reader->eventfd);
+  return NULL;
+}
+
+JoystickReader* JoystickReader_start(const Joystick* js) {
+  JoystickReader* reader = calloc(1, sizeof(JoystickReader));
+  if (NULL == reader) {
+    return NULL;
+  }
+
+  reader->js = *js;
+  reader->back = 0;
+  atomic_init(&reader->middle, 1);
+  reader->front = 2;
+  atomic_init(&reader->error, 0);
+
+  reader->lockstep = Joystick_isFastReplay(js);
+
+  reader->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  reader->stopfd = eventfd(0, EFD_CLOEXEC);
+  reader->takenfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (-1 == reader->eventfd || -1 == reader->stopfd || -1 == reader->takenfd) {
+    goto fail;
+  }
+
+  int err = pthread_create(&reader->thread, NULL, run, reader);
+  if (err) {
+    errno = err;
+    goto fail;
+  }
+  return reader;
+
+fail:
+  if (-1 != reader->eventfd) {
+    close(reader->eventfd);
+  }
+  if (-1 != reader->stopfd) {
+    close(reader->stopfd);
+  }
+  if (-1 != reader->takenfd) {
+    close(reader->takenfd);
+  }
+  free(reader);
+  return NULL;
+}
+
+int JoystickReader_fd(const JoystickReader* reader) {
+  return reader->eventfd;
+}
+
+int JoystickReader_snapshot(JoystickReader* reader, JoystickState* state) {
+  int fresh = 0;
+
+  if (atomic_load_explicit(&reader->middle, memory_order_acquire) & FRESH) {
+    unsigned old = atomic_exchange_explicit(&reader->middle, reader->front,
+                                            memory_order_acq_rel);
+    reader->front = old & INDEX;
+    fresh = 1;
+
+    if (reader->lockstep) {
+      notify(reader->takenfd);
+    }
+  }
+
+  *state = reader->buffers[reader->front];
+
+  int err = atomic_load(&reader->error);
+  if (!fresh && err) {
+    errno = err;
+    return -1;
+  }
+  return fresh;
+}
+
+void JoystickReader_stop(JoystickReader* reader) {
+  notify(reader->stopfd);
+  pthread_join(reader->thread, NULL);
+  close(reader->eventfd);
+  close(reader->stopfd);
+  close(reader->takenfd);
+  free(reader);
+}
@@ -8,10 +8,13 @@
  */
 
 #include "serial.h"
+#include "io.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,10 +22,7 @@
 #include <string.h> // memset
 #include <errno.h>
 
-static void pabort(const char *s) {
-  perror(s);
-  abort();
-}
+#include <linux/serial.h>
 
 void SerialOptions_init(SerialOptions* opts) {
   strncpy(opts->device, DEFAULT_TTY_DEVICE, PATH_MAX);
@@ -30,6 +30,28 @@ void SerialOptions_init(SerialOptions* opts) {
   opts->baudrate = DEFAULT_TTY_BAUD;
   opts->parity = DEFAULT_TTY_PARITY;
   opts->stop_bits = DEFAULT_TTY_STOP_BITS;
+  opts->low_latency = 0;
+  opts->vmin = DEFAULT_TTY_VMIN;
+  opts->vtime = DEFAULT_TTY_VTIME;
+}
+
+/**
+ * @brief Ask the driver to push received bytes to readers right away
+ * instead of batching them.  Not every driver supports this (ptys and many
+ * USB adapters don't), so failure is only worth a warning.
+ * @param fd
+ */
+static void set_low_latency(int fd) {
+  struct serial_struct serial;
+  if (-1 == ioctl(fd, TIOCGSERIAL, &serial)) {
+    perror("warning: can't get serial driver flags for low latency mode");
+    return;
+  }
+
+  serial.flags |= ASYNC_LOW_LATENCY;
+  if (-1 == ioctl(fd, TIOCSSERIAL, &serial)) {
+    perror("warning: can't enable low latency mode");
+  }
 }
 
 int SerialOptions_open(const SerialOptions* opts) {
@@ -76,7 +98,12 @@ int SerialOptions_open(const SerialOptions* opts) {
     break;
   }
 
+  /*
+   * Rates without a Bnnn code get a placeholder here and are set
+   * afterwards through termios2.
+   */
   speed_t speed = 0;
+  int custom_speed = 0;
   switch (opts->baudrate) {
   case 2400:
     speed = B2400;
@@ -100,8 +127,9 @@ int SerialOptions_open(const SerialOptions* opts) {
     speed = B230400;
     break;
   default:
-    fprintf(stderr, "Invalid baud rate: %d", opts->baudrate);
-    abort();
+    speed = B38400;
+    custom_speed = 1;
+    break;
   }
   if (-1 == cfsetispeed(&termopts, speed)) {
     pabort("Error setting input speed");
@@ -113,39 +141,124 @@ int SerialOptions_open(const SerialOptions* opts) {
   termopts.c_oflag &= ~OPOST;
 
   /*
-   * Only send data after 1 chars are in the buffer.
-   * Don't use a timer.
+   * By default, only send data after 1 chars are in the buffer
+   * and don't use a timer.
    */
   termopts.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL | ISIG | IEXTEN);
-  termopts.c_cc[VMIN] = 1;
+  termopts.c_cc[VMIN] = opts->vmin;
+  termopts.c_cc[VTIME] = opts->vtime;
 
   if (-1 == tcsetattr(fd, TCSAFLUSH, &termopts)) {
     pabort("Error setting serial line options");
   }
 
+  if (custom_speed && -1 == serial_set_baudrate(fd, opts->baudrate)) {
+    fprintf(stderr, "Invalid baud rate %u: %s\n", opts->baudrate, strerror(errno));
+    abort();
+  }
+
+  if (opts->low_latency) {
+    set_low_latency(fd);
+  }
+
   return fd;
 }
 
-void writetty(int fd, const void* data, size_t length) {
-  for (size_t i = 0; i < length; ++i) {
-    if (-1 == write(fd, data+i, 1)) {
-      pabort("writing data to tty");
+/**
+ * @brief Wait for "fd" to become ready for "events".
+ * @return 1 when ready, 0 on timeout, -1 on error.
+ */
+static int wait_fd(int fd, short events, int timeout_ms) {
+  struct pollfd pfd = { fd, events, 0 };
+  int ready;
+  do {
+    ready = poll(&pfd, 1, timeout_ms);
+  } while (-1 == ready && EINTR == errno);
+  return ready;
+}
+
+ssize_t writettyv(int fd, const struct iovec* iov, int iovcnt, int drain) {
+  if (iovcnt < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (0 == iovcnt) {
+    return 0;
+  }
+
+  /* Keep a copy we can advance past whatever a short write(2) took. */
+  struct iovec pending[iovcnt];
+  memcpy(pending, iov, sizeof(pending));
+
+  size_t total = 0;
+  int first = 0;
+  while (first < iovcnt) {
+    ssize_t written = writev(fd, &pending[first], iovcnt - first);
+    if (-1 == written) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if (EAGAIN == errno && -1 != wait_fd(fd, POLLOUT, -1)) {
+        continue;
+      }
+      return -1;
+    }
+
+    total += written;
+    while (first < iovcnt && (size_t)written >= pending[first].iov_len) {
+      written -= pending[first++].iov_len;
     }
-    if (-1 == tcdrain(fd)) {
-      pabort("draining tty");
+    if (first < iovcnt) {
+      pending[first].iov_base = (uint8_t*)pending[first].iov_base + written;
+      pending[first].iov_len -= written;
     }
   }
-  /* if (-1 == write(fd, data, length)) { */
-  /*   pabort("wrtiing data to tty"); */
-  /* } */
+
+  if (drain && -1 == tcdrain(fd)) {
+    return -1;
+  }
+
+  return total;
+}
+
+ssize_t writetty(int fd, const void* data, size_t length) {
+  struct iovec iov = { (void*)data, length };
+  return writettyv(fd, &iov, 1, 0);
 }
 
-uint8_t readtty(int fd) {
-  uint8_t b;
+ssize_t readtty_n(int fd, void* buf, size_t n, int timeout_ms) {
+  int64_t deadline = monotonic_ms() + timeout_ms;
+  size_t got = 0;
+
+  while (got < n) {
+    int remaining = -1;
+    if (timeout_ms >= 0) {
+      int64_t left = deadline - monotonic_ms();
+      remaining = left > 0 ? left : 0;
+    }
+
+    int ready = wait_fd(fd, POLLIN, remaining);
+    if (-1 == ready) {
+      return -1;
+    }
+    if (0 == ready) {
+      errno = ETIMEDOUT;
+      return got;
+    }
 
-  if (-1 == read(fd, &b, sizeof(uint8_t))) {
-    pabort("reading tty");
+    ssize_t count = read(fd, (uint8_t*)buf + got, n - got);
+    if (-1 == count) {
+      if (EINTR == errno || EAGAIN == errno) {
+        continue;
+      }
+      return -1;
+    }
+    if (0 == count) {
+      errno = EIO;
+      return got;
+    }
+    got += count;
   }
 
-  return b;
+  return got;
 }
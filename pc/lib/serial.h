@@ -12,6 +12,8 @@
 #include <stdint.h>
 #include <linux/limits.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,12 +39,23 @@ extern "C" {
 #  define DEFAULT_TTY_STOP_BITS 1
 #endif
 
+#ifndef DEFAULT_TTY_VMIN
+#  define DEFAULT_TTY_VMIN 1
+#endif
+
+#ifndef DEFAULT_TTY_VTIME
+#  define DEFAULT_TTY_VTIME 0
+#endif
+
 typedef struct {
   char device[PATH_MAX]; // path to serial device
   uint8_t bits_per_word;
-  uint32_t baudrate;
+  uint32_t baudrate;     // any rate the driver accepts, e.g. 250000
   uint8_t parity;
   uint8_t stop_bits;
+  uint8_t low_latency;   // ask the driver not to batch received data
+  uint8_t vmin;          // bytes a blocking read(2) waits for
+  uint8_t vtime;         // read(2) inter-byte timeout, in tenths of a second
 } SerialOptions;
 
 /**
@@ -60,20 +73,59 @@ void SerialOptions_init(SerialOptions* opts);
 int SerialOptions_open(const SerialOptions* opts);
 
 /**
- * @brief Send a byte of data.  This function can handle a blocking
+ * @brief Set the baud rate of an open serial device through termios2, which
+ * accepts any rate the driver can produce rather than just the Bnnn codes.
+ * @param fd
+ * @param baudrate
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int serial_set_baudrate(int fd, uint32_t baudrate);
+
+/**
+ * @brief Read back the output baud rate an open serial device is set to.
+ * @param fd
+ * @param baudrate Set to the rate on success.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int serial_get_baudrate(int fd, uint32_t* baudrate);
+
+/**
+ * @brief Send several buffers of data with as few write(2) calls as the
+ * driver allows (normally one).  This function can handle a blocking
  * or non-blocking file descriptor.
- * @param fd The file descriptor where a byte will be written.
- * @param data The byte of data to write.
+ * @param fd The file descriptor where the data will be written.
+ * @param iov The buffers to send, in order.
+ * @param iovcnt The number of buffers in "iov".
+ * @param drain If non-zero, also wait for the data to leave the UART.
+ * @return The number of bytes written, which is all of them, or -1 with
+ * errno set (EINVAL if "iovcnt" is negative).
+ */
+ssize_t writettyv(int fd, const struct iovec* iov, int iovcnt, int drain);
+
+/**
+ * @brief Send a buffer of data in one go, without draining.
+ * @param fd The file descriptor where the data will be written.
+ * @param data The data to write.
+ * @param length The number of bytes in "data".
+ * @return The number of bytes written, which is all of them, or -1 with
+ * errno set.
  */
-void writetty(int fd, const void* data, size_t length);
+ssize_t writetty(int fd, const void* data, size_t length);
 
 /**
- * @brief Receive a byte of data.  The function can handle a
- * blocking or non-blocking file descriptor.
- * @param fd The file descriptor from which a byte will be read.
- * @returns A byte of data read from the file descriptor.
+ * @brief Receive "n" bytes of data, reading as many as are available per
+ * read(2).  The function can handle a blocking or non-blocking file
+ * descriptor.
+ * @param fd The file descriptor from which data will be read.
+ * @param buf Where to store the data.
+ * @param n The number of bytes to read.
+ * @param timeout_ms How long to wait for all "n" bytes, in milliseconds,
+ * or -1 to wait forever.
+ * @returns The number of bytes read.  If that's fewer than "n", errno is
+ * ETIMEDOUT, or EIO if the other end went away.  -1 with errno set on
+ * any other error.
  */
-uint8_t readtty(int fd);
+ssize_t readtty_n(int fd, void* buf, size_t n, int timeout_ms);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,41 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ *
+ * Arbitrary baud rates through Linux's termios2 interface.  This lives apart
+ * from serial.c because <asm/termbits.h> redefines most of <termios.h>.
+ */
+
+#include "serial.h"
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+int serial_set_baudrate(int fd, uint32_t baudrate) {
+  struct termios2 tio;
+  if (-1 == ioctl(fd, TCGETS2, &tio)) {
+    return -1;
+  }
+
+  /* BOTHER takes the rates from c_ispeed/c_ospeed instead of a Bnnn code. */
+  tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tio.c_ispeed = baudrate;
+  tio.c_ospeed = baudrate;
+
+  return ioctl(fd, TCSETS2, &tio);
+}
+
+int serial_get_baudrate(int fd, uint32_t* baudrate) {
+  struct termios2 tio;
+  if (-1 == ioctl(fd, TCGETS2, &tio)) {
+    return -1;
+  }
+
+  *baudrate = tio.c_ospeed;
+  return 0;
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# This Source Code Form is subject to the terms of the
+# Mozilla Public License, v. 2.0.  If a copy of the MPL
+# was not distributed with this file, you can obtain one at
+# https://mozilla.org/MPL/2.0/.
+#
+# Copyright William Grim, 2015
+#
+# Usage: replaycheck.sh SERVOSIM JSMASTER RECORDING CONFIG BAUD
+#
+# Replay RECORDING through jsmaster to a fresh servosim in real time, then
+# with --fast and with --fast --threaded, and check that the fast replays
+# send about as many commands as the real-time one.  A fast replay that
+# skips reports sends far fewer, and measures nothing.
+
+if [ $# -ne 5 ]; then
+  echo "usage: $0 SERVOSIM JSMASTER RECORDING CONFIG BAUD" >&2
+  exit 1
+fi
+
+servosim=$1
+jsmaster=$2
+recording=$3
+config=$4
+baud=$5
+
+if [ ! -r "$recording" ]; then
+  echo "$0: can't read recording '$recording'; set REPLAY_JSR" >&2
+  exit 1
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+tty=$tmp/tty
+
+# Print the number of commands jsmaster sent with options "$1".
+replay() {
+  "$servosim" -b "$baud" -L "$tty" > "$tmp/servosim.log" 2>&1 &
+  sim=$!
+  while [ ! -e "$tty" ] && kill -0 $sim 2>/dev/null; do
+    sleep 0.1
+  done
+
+  "$jsmaster" -t "$tty" -b "$baud" -j "$recording" -c "$config" $1 \
+    > "$tmp/jsmaster.log" 2>&1
+  kill $sim 2>/dev/null
+  wait $sim
+  rm -f "$tty"
+
+  tr '\r' '\n' < "$tmp/jsmaster.log" | sed -n 's/^sent \([0-9]*\),.*/\1/p'
+}
+
+expected=$(replay "")
+if [ -z "$expected" ]; then
+  echo "real-time replay failed:"
+  tail -n 5 "$tmp/jsmaster.log"
+  exit 1
+fi
+echo "real time: $expected commands"
+
+# Reports near a tick boundary can land either side of it, so allow 5%.
+slack=$((expected / 20 + 1))
+status=0
+for mode in "--fast" "--fast --threaded"; do
+  sent=$(replay "$mode")
+  if [ -z "$sent" ]; then
+    echo "$mode: replay failed:"
+    tail -n 5 "$tmp/jsmaster.log"
+    status=1
+  elif [ $((sent - expected)) -gt $slack ] || [ $((expected - sent)) -gt $slack ]; then
+    echo "$mode: $sent commands, expected $expected +/- $slack"
+    status=1
+  else
+    echo "$mode: $sent commands"
+  fi
+done
+
+exit $status
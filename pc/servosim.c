@@ -0,0 +1,446 @@
+/**
+ * This Source Code Form is subject to the terms of the
+ * Mozilla Public License, v. 2.0.  If a copy of the MPL
+ * was not distributed with this file, you can obtain one at
+ * https://mozilla.org/MPL/2.0/.
+ *
+ * Copyright William Grim, 2015
+ *
+ * A stand-in for avr/servo.c on a pseudo-terminal, so jsmaster can be run
+ * and measured without an AVR.  It speaks the same frames and answers them
+ * the same way, while modelling the serial line's speed, the time the AVR
+ * takes to handle a frame, and bytes lost on the way in.
+ *
+ * The line is modelled with three clocks: bytes arrive no faster than the
+ * baud rate allows, frames are handled one after another, and acks leave
+ * no faster than the baud rate allows.  Each ack is written to the pty
+ * when the modelled AVR would have finished sending it.
+ */
+
+/* posix_openpt(3) and cfmakeraw(3). */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <termios.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "io.h"
+#include "channelmap.h"
+
+/* Must match avr/servo.c and avr/lib/servo.h. */
+#define NACK_BYTE 0xFF
+#define RESET_BYTE 0xFF
+#define SERVO_CHANNELS 2
+#define MAX_DEGREES 180
+
+/* Acks that may be waiting for the modelled line at once. */
+#define ACK_QUEUE_LEN 1024
+
+/* Options that may be set from the command-line. */
+static uint32_t baudrate = 9600;
+static int processUs = 50;
+static double lossRate = 0.0;
+static unsigned seed = 1;
+static const char* linkPath = NULL;
+static uint16_t ticksMin = CHANNEL_TICKS_MIN;
+static uint16_t ticksMax = CHANNEL_TICKS_MAX;
+static int verbose;
+
+/* Long options without a short equivalent. */
+#define OPT_TICKS_MIN 0x100
+#define OPT_TICKS_MAX 0x101
+#define OPT_SEED      0x102
+
+void print_usage(const char *prog) {
+  printf("Usage: %s [-bdlLv]\n", prog);
+  puts("  -b --baud     modelled line speed (default 9600); 0 for no pacing\n"
+       "  -d --delay    us the AVR takes to handle a frame (default 50)\n"
+       "  -l --loss     chance, 0 to 1, of losing each received byte (default 0)\n"
+       "     --seed     seed for the loss pattern (default 1)\n"
+       "  -L --link     also make this symlink to the pty\n"
+       "     --ticks-min  lowest tick count accepted (default 500)\n"
+       "     --ticks-max  highest tick count accepted (default 1000)\n"
+       "  -v --verbose  print every frame\n");
+  exit(1);
+}
+
+static long parse_long(const char* name, long min, long max) {
+  char* end;
+  long val = strtol(optarg, &end, 10);
+  if ('\0' != *end || val < min || val > max) {
+    fprintf(stderr, "Invalid --%s given; must be %ld-%ld.\n", name, min, max);
+    exit(1);
+  }
+  return val;
+}
+
+void parse_opts(int argc, char *argv[]) {
+  static const struct option lopts[] = {
+    { "baud",      1, 0, 'b' },
+    { "delay",     1, 0, 'd' },
+    { "loss",      1, 0, 'l' },
+    { "seed",      1, 0, OPT_SEED },
+    { "link",      1, 0, 'L' },
+    { "ticks-min", 1, 0, OPT_TICKS_MIN },
+    { "ticks-max", 1, 0, OPT_TICKS_MAX },
+    { "verbose",   0, 0, 'v' },
+    { NULL,        0, 0, 0 },
+  };
+
+  while (1) {
+    int c = getopt_long(argc, argv, "b:d:l:L:v", lopts, NULL);
+    if (-1 == c) {
+      break;
+    }
+
+    switch (c) {
+    case 'b':
+      baudrate = parse_long("baud", 0, 10000000);
+      break;
+    case 'd':
+      processUs = parse_long("delay", 0, 10000000);
+      break;
+    case 'l': {
+      char* end;
+      lossRate = strtod(optarg, &end);
+      if ('\0' != *end || lossRate < 0.0 || lossRate > 1.0) {
+        fprintf(stderr, "Invalid --loss given; must be 0-1.\n");
+        exit(1);
+      }
+      break;
+    }
+    case OPT_SEED:
+      seed = parse_long("seed", 0, UINT_MAX);
+      break;
+    case 'L':
+      linkPath = optarg;
+      break;
+    case OPT_TICKS_MIN:
+      ticksMin = parse_long("ticks-min", 0, UINT16_MAX);
+      break;
+    case OPT_TICKS_MAX:
+      ticksMax = parse_long("ticks-max", 0, UINT16_MAX);
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+}
+
+static struct {
+  unsigned long received;
+  unsigned long lost;
+  unsigned long frames;
+  unsigned long acks;
+  unsigned long nacks;
+  unsigned long abandoned;   // frames cut short by a RESET_BYTE
+  unsigned long skipped;     // RESET_BYTEs between frames
+} stats;
+
+static void print_stats(void) {
+  printf("\nbytes received %lu, lost %lu\n"
+         "frames %lu, acked %lu, nacked %lu, abandoned %lu, reset bytes %lu\n",
+         stats.received, stats.lost, stats.frames, stats.acks, stats.nacks,
+         stats.abandoned, stats.skipped);
+}
+
+/* Compare ticks of each channel, as OCR1A and OCR1B would hold them. */
+static uint16_t channels[SERVO_CHANNELS];
+
+/* The frame being received, in the same order servo.c reads it. */
+static uint8_t frame[2 + 2 * SERVO_CHANNELS];
+static unsigned frameLength;
+
+/**
+ * @brief Payload bytes that follow "cmd", as servo.c reads them.
+ */
+static unsigned payload_length(uint8_t cmd) {
+  switch (cmd) {
+  case 'M': return SERVO_CHANNELS;
+  case 'T': return 2 * SERVO_CHANNELS;
+  case 'C': return 3;
+  default:  return 2;   // 'L', 'R', and unknown commands
+  }
+}
+
+static uint16_t degrees_to_ticks(unsigned degrees) {
+  return ticksMin + (uint32_t)(ticksMax - ticksMin) * degrees / MAX_DEGREES;
+}
+
+static int ticks_ok(uint16_t ticks) {
+  return ticks >= ticksMin && ticks <= ticksMax;
+}
+
+/**
+ * @brief Apply a complete frame the way servo.c does.
+ * @return The byte to answer with.
+ */
+static uint8_t apply_frame(void) {
+  uint8_t msgid = frame[0];
+  uint8_t cmd = frame[1];
+  const uint8_t* p = &frame[2];
+  uint16_t ticks[SERVO_CHANNELS];
+  int ok = 1;
+
+  switch (cmd) {
+  case 'L':
+  case 'R': {
+    int16_t value = p[0] << 8 | p[1];
+    ok = value >= 0 && value <= MAX_DEGREES;
+    if (ok) {
+      channels['L' == cmd ? 0 : 1] = degrees_to_ticks(value);
+    }
+    break;
+  }
+  case 'M':
+    for (int i = 0; i < SERVO_CHANNELS; ++i) {
+      ok &= p[i] <= MAX_DEGREES;
+      ticks[i] = degrees_to_ticks(p[i]);
+    }
+    if (ok) {
+      memcpy(channels, ticks, sizeof(channels));
+    }
+    break;
+  case 'T':
+    for (int i = 0; i < SERVO_CHANNELS; ++i) {
+      ticks[i] = p[2 * i] << 8 | p[2 * i + 1];
+      ok &= ticks_ok(ticks[i]);
+    }
+    if (ok) {
+      memcpy(channels, ticks, sizeof(channels));
+    }
+    break;
+  case 'C': {
+    uint16_t value = p[1] << 8 | p[2];
+    ok = p[0] < SERVO_CHANNELS && ticks_ok(value);
+    if (ok) {
+      channels[p[0]] = value;
+    }
+    break;
+  }
+  default:
+    ok = 0;
+    break;
+  }
+
+  ++stats.frames;
+  if (ok) {
+    ++stats.acks;
+  } else {
+    ++stats.nacks;
+  }
+  if (verbose) {
+    printf("frame %3u '%c' %s, channels %u/%u\n", msgid, cmd >= ' ' && cmd < 0x7F ? cmd : '?',
+           ok ? "ok" : "NACK", channels[0], channels[1]);
+  }
+  return ok ? msgid : NACK_BYTE;
+}
+
+/**
+ * @brief Feed one received byte to the frame parser.
+ * @return 1 if it completed a frame, 0 otherwise.
+ */
+static int receive_byte(uint8_t byte) {
+  if (frameLength < 2 && RESET_BYTE == byte) {
+    if (0 == frameLength) {
+      ++stats.skipped;
+    } else {
+      ++stats.abandoned;
+    }
+    frameLength = 0;
+    return 0;
+  }
+
+  frame[frameLength++] = byte;
+  if (frameLength >= 2 && frameLength == 2 + payload_length(frame[1])) {
+    return 1;
+  }
+  return 0;
+}
+
+/* Acks in the order the modelled line sends them. */
+static struct {
+  int64_t due;      // monotonic_us when its last bit has been sent
+  uint8_t byte;
+} acks[ACK_QUEUE_LEN];
+static unsigned ackHead;
+static unsigned ackCount;
+
+/* When the modelled receiver, AVR and transmitter are next free, in us. */
+static int64_t rxFree;
+static int64_t cpuFree;
+static int64_t txFree;
+
+/**
+ * @brief Microseconds the line takes for one byte: a start bit, 8 data
+ * bits and a stop bit.
+ */
+static int64_t byte_us(void) {
+  return baudrate ? 10 * 1000000LL / baudrate : 0;
+}
+
+static int64_t later(int64_t a, int64_t b) {
+  return a > b ? a : b;
+}
+
+/**
+ * @brief Run bytes just read from the pty through the modelled line.
+ */
+static void receive(const uint8_t* bytes, ssize_t count) {
+  int64_t now = monotonic_us();
+
+  for (ssize_t i = 0; i < count; ++i) {
+    ++stats.received;
+    rxFree = later(rxFree, now) + byte_us();
+
+    if (lossRate > 0.0 && (double)rand_r(&seed) / RAND_MAX < lossRate) {
+      ++stats.lost;
+      continue;
+    }
+    if (!receive_byte(bytes[i])) {
+      continue;
+    }
+
+    uint8_t answer = apply_frame();
+    frameLength = 0;
+
+    cpuFree = later(cpuFree, rxFree) + processUs;
+    txFree = later(txFree, cpuFree) + byte_us();
+    if (ACK_QUEUE_LEN == ackCount) {
+      fprintf(stderr, "ack queue overflowed; is anything reading the pty?\n");
+      exit(1);
+    }
+    acks[(ackHead + ackCount) % ACK_QUEUE_LEN].due = txFree;
+    acks[(ackHead + ackCount) % ACK_QUEUE_LEN].byte = answer;
+    ++ackCount;
+  }
+}
+
+/**
+ * @brief Write out every ack whose modelled transmission has finished.
+ */
+static void send_due_acks(int fd) {
+  int64_t now = monotonic_us();
+  uint8_t out[ACK_QUEUE_LEN];
+  size_t count = 0;
+
+  while (ackCount > 0 && acks[ackHead].due <= now) {
+    out[count++] = acks[ackHead].byte;
+    ackHead = (ackHead + 1) % ACK_QUEUE_LEN;
+    --ackCount;
+  }
+
+  if (count > 0 && -1 == write(fd, out, count)) {
+    pabort("writing acks");
+  }
+}
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+int main(int argc, char* argv[]) {
+  parse_opts(argc, argv);
+  if (ticksMin >= ticksMax) {
+    fprintf(stderr, "--ticks-min must be below --ticks-max.\n");
+    exit(1);
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (-1 == master || -1 == grantpt(master) || -1 == unlockpt(master)) {
+    pabort("opening pty");
+  }
+  const char* slavePath = ptsname(master);
+  if (NULL == slavePath) {
+    pabort("naming pty");
+  }
+
+  /*
+   * Hold the slave open ourselves, so the master doesn't hang up between
+   * clients, and make it raw until a client configures it.
+   */
+  int slave = open(slavePath, O_RDWR | O_NOCTTY);
+  if (-1 == slave) {
+    pabort("opening %s", slavePath);
+  }
+  struct termios tio;
+  if (-1 == tcgetattr(slave, &tio)) {
+    pabort("reading %s settings", slavePath);
+  }
+  cfmakeraw(&tio);
+  if (-1 == tcsetattr(slave, TCSANOW, &tio)) {
+    pabort("setting %s raw", slavePath);
+  }
+
+  if (linkPath) {
+    unlink(linkPath);
+    if (-1 == symlink(slavePath, linkPath)) {
+      pabort("linking %s", linkPath);
+    }
+  }
+
+  printf("servo on %s%s%s, %u baud, %d us per frame, %.3f loss\n", slavePath,
+         linkPath ? " via " : "", linkPath ? linkPath : "", baudrate, processUs, lossRate);
+  fflush(stdout);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  channels[0] = channels[1] = degrees_to_ticks(MAX_DEGREES / 2);
+
+  while (!stopping) {
+    int timeout = -1;
+    if (ackCount > 0) {
+      int64_t wait = acks[ackHead].due - monotonic_us();
+      timeout = wait > 0 ? (wait + 999) / 1000 : 0;
+    }
+
+    struct pollfd pfd = { master, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout);
+    if (-1 == ready) {
+      if (EINTR == errno) {
+        continue;
+      }
+      pabort("waiting for the pty");
+    }
+
+    if (ready && (pfd.revents & POLLIN)) {
+      uint8_t bytes[256];
+      ssize_t got = read(master, bytes, sizeof(bytes));
+      if (-1 == got && EINTR != errno && EAGAIN != errno) {
+        pabort("reading the pty");
+      }
+      if (got > 0) {
+        receive(bytes, got);
+      }
+    }
+
+    send_due_acks(master);
+  }
+
+  if (linkPath) {
+    unlink(linkPath);
+  }
+  print_stats();
+  return 0;
+}